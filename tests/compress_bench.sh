@@ -0,0 +1,33 @@
+#!/bin/sh
+# Throughput of the compressed redirections [<z] and [>z], whose codec runs on a helper
+# thread of the shell, against the same work through a zcat/gzip process and a pipe,
+# measured with tinyshell's own [bench] prefix. zstd is skipped if zstd(1) is not found
+#
+# compress_bench.sh [TINYSHELL] [MEGABYTES] [RUNS]        (defaults: ./tinyshell, 40, 10)
+
+shell=$(realpath "${1:-./tinyshell}")
+size=$((${2:-40} * 1024 * 1024))
+runs=${3:-10}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Text which compresses like logs do
+seq 1 100000000 | head -c "$size" > "$work/big"
+gzip -c "$work/big" > "$work/big.gz"
+
+bench() {
+    echo "== $1"
+    TINYSHELLRC=/nonexistent "$shell" -c "bench -n $runs -w 1 -q $1"
+}
+
+bench "wc -c <z $work/big.gz"
+bench "zcat $work/big.gz | wc -c"
+
+if command -v zstd > /dev/null; then
+    zstd -q -c "$work/big" > "$work/big.zst"
+    bench "wc -c <z $work/big.zst"
+    bench "zstd -dc $work/big.zst | wc -c"
+fi
+
+bench "cat $work/big >z $work/out.gz"
+bench "cat $work/big | gzip -c > $work/out.gz"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Throughput of a fan-out pipeline, one producer copied to three [wc -c] branches by
+# tinyshell's tee/splice process, against the same graph built with tee(1) and process
+# substitution, measured with tinyshell's own [bench] prefix
+#
+# fanout_bench.sh [TINYSHELL] [MEGABYTES] [RUNS]        (defaults: ./tinyshell, 2048, 5)
+
+shell=$(realpath "${1:-./tinyshell}")
+size=$((${2:-2048} * 1024 * 1024))
+runs=${3:-5}
+
+bench() {
+    echo "== $1"
+    TINYSHELLRC=/nonexistent "$shell" -c "bench -n $runs -w 1 -q $1"
+}
+
+bench "head -c $size /dev/zero |* wc -c |* wc -c |* wc -c"
+bench "head -c $size /dev/zero | tee >(wc -c) >(wc -c) | wc -c"
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Builtin-heavy pipelines with their builtins and filters run on threads joined by rings
+# ([set -o inprocess], the default), then with every stage forked ([set +o inprocess]),
+# measured with tinyshell's own [bench] prefix
+#
+# inprocess_bench.sh [TINYSHELL] [RUNS]        (defaults: ./tinyshell, 200)
+
+shell=$(realpath "${1:-./tinyshell}")
+runs=${2:-200}
+
+for pipeline in "echo hello | cat | cat | wc -l" \
+                "cwd | cat | head -n 1 | wc -c" \
+                "ver | cat | cat | cat | wc -l" \
+                "seq 1 1000000 | cat | cat | wc -l"; do
+    for mode in -o +o; do
+        echo "== set $mode inprocess: $pipeline"
+        TINYSHELLRC=/nonexistent "$shell" -c "set $mode inprocess; bench -n $runs -w 5 -q $pipeline"
+    done
+done
@@ -0,0 +1,208 @@
+/* ------------------------------------- scan_test.c  ------------------------------------- */
+/* Checks every scan_plain() kernel of tinyshell/scan.c against the scalar one, which       */
+/* defines the behaviour: each special character at every offset of buffers of length 0 to  */
+/* 64 (both sides of the 16 and 32 byte blocks), then random buffers of random lengths and  */
+/* densities, quoted and unquoted. The dispatching scan_plain() is checked the same way.    */
+/*                                                                                          */
+/* scan_test             run the checks, exit status 1 on the first mismatch                */
+/* scan_test --bench     throughput of each kernel on command-line-like text                */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The kernels are static, so the file is compiled into the test
+#include "../tinyshell/scan.c"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define MAX_EDGE 64        // Buffers of every length up to this are checked exhaustively
+#define RANDOM_RUNS 200000 // Random buffers checked per kernel
+#define MAX_RANDOM 512     // Longest random buffer
+#define BENCH_SIZE (16 * 1024 * 1024)
+#define BENCH_ROUNDS 20
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+typedef struct
+{
+    const char *name;
+    size_t (*scan)(const char *s, size_t n, bool quoted);
+} kernel_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static kernel_t kernels[4];
+static int kernel_count = 0;
+static long checks = 0;
+
+// Every kernel the CPU runs, the dispatcher last
+static void find_kernels(void)
+{
+    kernels[kernel_count++] = (kernel_t){"scalar", scan_scalar};
+
+#ifdef SCAN_SIMD
+    kernels[kernel_count++] = (kernel_t){"sse2", scan_sse2};
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        kernels[kernel_count++] = (kernel_t){"avx2", scan_avx2};
+    else
+        printf("avx2: not supported by this CPU, skipped\n");
+#endif
+
+    kernels[kernel_count++] = (kernel_t){"scan_plain", scan_plain};
+}
+
+/* --------------------------------------- CHECKS ---------------------------------------- */
+// Compare every kernel with the scalar one on s[0..n), returns 0, or -1 on a mismatch
+static int check(const char *s, size_t n, bool quoted)
+{
+    size_t expected = scan_scalar(s, n, quoted);
+
+    for (int k = 1; k < kernel_count; k++)
+    {
+        size_t found = kernels[k].scan(s, n, quoted);
+
+        checks++;
+
+        if (found != expected)
+        {
+            fprintf(stderr, "%s: %zu instead of %zu (length %zu, %s)\n", kernels[k].name, found, expected, n,
+                    quoted ? "quoted" : "unquoted");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// A buffer of plain characters, then each special character at each offset. The buffer is
+// placed at every alignment of a block, since the kernels use unaligned loads
+static int check_edges(void)
+{
+    char buffer[MAX_EDGE + 32];
+
+    for (size_t align = 0; align < 32; align++)
+    {
+        char *s = buffer + align;
+
+        for (size_t n = 0; n <= MAX_EDGE; n++)
+        {
+            memset(s, 'a', n);
+
+            if (check(s, n, false) == -1 || check(s, n, true) == -1)
+                return -1;
+
+            for (size_t at = 0; at < n; at++)
+            {
+                for (size_t k = 0; k < COUNT(unquoted_specials); k++)
+                {
+                    s[at] = unquoted_specials[k];
+
+                    if (check(s, n, false) == -1 || check(s, n, true) == -1)
+                        return -1;
+                }
+
+                s[at] = 'a';
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Random buffers mixing plain bytes (including bytes above 0x7f, which are negative as
+// char) with specials at a random density
+static int check_random(void)
+{
+    static char buffer[MAX_RANDOM];
+
+    for (int run = 0; run < RANDOM_RUNS; run++)
+    {
+        size_t n = rand() % (MAX_RANDOM + 1);
+        int density = 1 + rand() % 200;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (rand() % density == 0)
+                buffer[i] = unquoted_specials[rand() % COUNT(unquoted_specials)];
+            else
+                buffer[i] = (char)(rand() % 256);
+        }
+
+        if (check(buffer, n, run % 2) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* --------------------------------------- BENCHMARK ------------------------------------- */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Words of a command line, as read_word() sees them: scan a run, step over the special
+static void bench(void)
+{
+    static const char *words[] = {"grep", "-rn", "--include=*.c", "execute_pipeline", "/usr/local/src/tinyshell",
+                                  "|", "sort", "-k2,2n", ">", "output.txt", "\"a quoted argument\"", "$HOME"};
+    char *text = malloc(BENCH_SIZE);
+
+    if (!text)
+    {
+        perror("malloc() failed");
+        return;
+    }
+
+    for (size_t length = 0, w = 0; length < BENCH_SIZE; w = (w + 1) % COUNT(words))
+    {
+        for (const char *c = words[w]; *c && length < BENCH_SIZE; c++)
+            text[length++] = *c;
+
+        if (length < BENCH_SIZE)
+            text[length++] = ' ';
+    }
+
+    for (int k = 0; k < kernel_count; k++)
+    {
+        double started = now();
+        size_t runs = 0;
+
+        for (int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            for (size_t i = 0; i < BENCH_SIZE; runs++)
+                i += kernels[k].scan(text + i, BENCH_SIZE - i, false) + 1;
+        }
+
+        double elapsed = now() - started;
+
+        printf("%-12s %6.2f GB/s  %6.1f ns per word\n", kernels[k].name, BENCH_ROUNDS * (double)BENCH_SIZE / elapsed / 1e9,
+               elapsed / runs * 1e9);
+    }
+
+    free(text);
+}
+
+int main(int argc, char *argv[])
+{
+    find_kernels();
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        bench();
+        return EXIT_SUCCESS;
+    }
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    if (check_edges() == -1 || check_random() == -1)
+        return EXIT_FAILURE;
+
+    printf("%d kernels agree with the scalar kernel (%ld checks)\n", kernel_count - 1, checks);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Startup time of tinyshell with a cacheable rc file, run line by line (no snapshot) and
+# applied from its snapshot, measured with tinyshell's own [bench] prefix
+#
+# startup_bench.sh [TINYSHELL] [RUNS]        (defaults: ./tinyshell, 200)
+
+shell=$(realpath "${1:-./tinyshell}")
+runs=${2:-200}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# 100 aliases, 100 exports and a few options, as a long-lived rc file might have
+{
+    i=0
+    while [ $i -lt 100 ]; do
+        echo "alias a$i=\"ls -la /tmp/$i\""
+        echo "export VARIABLE_$i=value_$i"
+        i=$((i + 1))
+    done
+    echo "set -o pipefail"
+    echo "set -o scrollback=1M"
+} > "$work/cached.rc"
+
+# The same file with a line which is not cacheable, so it is run on every start
+cp "$work/cached.rc" "$work/uncached.rc"
+echo "cwd > /dev/null" >> "$work/uncached.rc"
+
+for rc in uncached cached; do
+    echo "== $rc rc file"
+    XDG_CACHE_HOME="$work/cache" TINYSHELLRC="$work/$rc.rc" "$shell" -c true
+    XDG_CACHE_HOME="$work/cache" TINYSHELLRC=/nonexistent "$shell" -c \
+        "bench -n $runs -w 5 env XDG_CACHE_HOME=$work/cache TINYSHELLRC=$work/$rc.rc $shell -c true"
+done
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Processes and latency of tinyshell running a command line or a script whose last command
+# is exec'd in place of the shell, against the same line forced to fork it (a builtin runs
+# after it). Processes per run are counted from the kernel's last allocated pid, so other
+# activity on the machine adds to them; latency is measured with tinyshell's [bench] prefix
+#
+# tailexec_bench.sh [TINYSHELL] [RUNS]        (defaults: ./tinyshell, 200)
+
+shell=$(realpath "${1:-./tinyshell}")
+runs=${2:-200}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+printf 'cat /dev/null\ncat /dev/null\n' > "$work/exec.sh"
+printf 'cat /dev/null\ncat /dev/null\nset +e\n' > "$work/fork.sh"
+
+# run -c LINE | run SCRIPT: tinyshell runs LINE, or reads SCRIPT as a file on its STDIN
+run() {
+    if [ "$1" = -c ]; then
+        TINYSHELLRC=/nonexistent "$shell" -c "$2"
+    else
+        TINYSHELLRC=/nonexistent "$shell" < "$1"
+    fi
+}
+
+# Processes started per run, tinyshell included. The second cat(1) is one of them
+processes() {
+    first=$(cat /proc/sys/kernel/ns_last_pid)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        run "$@" > /dev/null
+        i=$((i + 1))
+    done
+    started=$(($(cat /proc/sys/kernel/ns_last_pid) - first - 1))
+    printf "  processes per run: %d.%02d\n" $((started / runs)) $((started * 100 / runs % 100))
+}
+
+# measure LABEL -c LINE | measure LABEL SCRIPT
+measure() {
+    echo "== $1"
+    shift
+    processes "$@"
+
+    if [ "$1" = -c ]; then
+        command="$shell -c \"$2\""
+    else
+        command="$shell < $1"
+    fi
+
+    TINYSHELLRC=/nonexistent "$shell" -c "bench -n $runs -w 5 -q env TINYSHELLRC=/nonexistent $command"
+}
+
+measure "-c, last command exec'd" -c "cat /dev/null"
+measure "-c, last command forked" -c "cat /dev/null; set +e"
+measure "script file, last command exec'd" "$work/exec.sh"
+measure "script file, last command forked" "$work/fork.sh"
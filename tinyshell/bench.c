@@ -0,0 +1,308 @@
+/* --------------------------------------- bench.c  --------------------------------------- */
+/* Provides the [bench] prefix, which runs a pipeline repeatedly and reports its wall time  */
+/* (mean, standard deviation, min, median, p95, p99, max) and the user and system time of   */
+/* its processes, taken from wait4(). The pipeline is parsed once and each run goes through */
+/* execute_pipeline(). The time the shell spends forking the stages is measured separately, */
+/* so slow runs (beyond the upper Tukey fence) are attributed either to the shell, if its   */
+/* spawn time was also an outlier, or to the command.                                       */
+/*                                                                                          */
+/* bench [-n RUNS] [-w WARMUP] [-q] command ...      (-q sends STDOUT to /dev/null)         */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define DEFAULT_RUNS 10
+#define DEFAULT_WARMUP 1
+#define OUTLIER_FENCE 1.5 // Tukey fence, in interquartile ranges above the third quartile
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Measurements of a single run
+typedef struct
+{
+    double wall;
+    double spawn;
+    double user;
+    double sys;
+} sample_t;
+
+/* --------------------------------------- PARSING --------------------------------------- */
+// Parse a positive count, returns -1 if invalid
+static int parse_count(const char *value, bool allow_zero)
+{
+    char *end;
+    long count = value ? strtol(value, &end, 10) : -1;
+
+    if (!value || end == value || *end != '\0' || count < !allow_zero || count > 1000000)
+        return -1;
+
+    return count;
+}
+
+// Parse [bench [-n RUNS] [-w WARMUP] [-q]] at the start of args
+// Returns the number of words consumed, or -1 on error
+int parse_bench_prefix(char **args, pipeline_attr_t *attr)
+{
+    int a = 1;
+
+    attr->bench_runs = DEFAULT_RUNS;
+    attr->bench_warmup = DEFAULT_WARMUP;
+
+    for (; args[a] && args[a][0] == '-'; a++)
+    {
+        if (strcmp(args[a], "-q") == 0)
+        {
+            attr->bench_quiet = true;
+            continue;
+        }
+
+        int *count = strcmp(args[a], "-n") == 0 ? &attr->bench_runs : strcmp(args[a], "-w") == 0 ? &attr->bench_warmup : NULL;
+
+        if (!count)
+        {
+            fprintf(stderr, "bench: invalid option [%s]\n", args[a]);
+            return -1;
+        }
+
+        if ((*count = parse_count(args[a + 1], count == &attr->bench_warmup)) == -1)
+        {
+            fprintf(stderr, "bench: invalid count [%s]\n", args[a + 1] ? args[a + 1] : "");
+            return -1;
+        }
+
+        a++;
+    }
+
+    if (!args[a])
+    {
+        fprintf(stderr, "bench: command required\n");
+        return -1;
+    }
+
+    return a;
+}
+
+/* --------------------------------------- TIMING ---------------------------------------- */
+// Seconds on the monotonic clock
+double bench_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* -------------------------------------- STATISTICS ------------------------------------- */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a,
+           y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile p of count sorted values
+static double percentile(const double *sorted, int count, double p)
+{
+    int rank = (int)ceil(p / 100 * count);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Values beyond this are outliers
+static double upper_fence(const double *sorted, int count)
+{
+    double q1 = percentile(sorted, count, 25),
+           q3 = percentile(sorted, count, 75);
+
+    return q3 + OUTLIER_FENCE * (q3 - q1);
+}
+
+// Format a duration with a unit suited to its magnitude
+static const char *format_time(char *buffer, size_t size, double value)
+{
+    if (value < 1e-3)
+        snprintf(buffer, size, "%.1fus", value * 1e6);
+    else if (value < 1)
+        snprintf(buffer, size, "%.3fms", value * 1e3);
+    else
+        snprintf(buffer, size, "%.3fs", value);
+
+    return buffer;
+}
+
+static void report(const sample_t *samples, int count, int warmup, int failed)
+{
+    double *wall = malloc(count * sizeof(*wall)),
+           *spawn = malloc(count * sizeof(*spawn));
+
+    if (!wall || !spawn)
+    {
+        perror("malloc() failed");
+        free(wall);
+        free(spawn);
+        return;
+    }
+
+    double mean = 0, variance = 0, user = 0, sys = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        wall[i] = samples[i].wall;
+        spawn[i] = samples[i].spawn;
+        mean += samples[i].wall;
+        user += samples[i].user;
+        sys += samples[i].sys;
+    }
+
+    mean /= count;
+
+    for (int i = 0; i < count; i++)
+    {
+        variance += (samples[i].wall - mean) * (samples[i].wall - mean);
+    }
+
+    double stddev = count > 1 ? sqrt(variance / (count - 1)) : 0;
+
+    qsort(wall, count, sizeof(*wall), compare_doubles);
+    qsort(spawn, count, sizeof(*spawn), compare_doubles);
+
+    // A slow run is the shell's fault when its own part of the run was slow too
+    double wall_fence = upper_fence(wall, count),
+           spawn_fence = upper_fence(spawn, count);
+    int shell_outliers = 0, command_outliers = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (samples[i].wall <= wall_fence)
+            continue;
+
+        if (samples[i].spawn > spawn_fence)
+            shell_outliers++;
+        else
+            command_outliers++;
+    }
+
+    char a[32], b[32], c[32], d[32], e[32];
+
+    printf("%d runs (%d warmup)", count, warmup);
+
+    if (failed > 0)
+        printf(", %d failed", failed);
+
+    printf("\n");
+    printf("  wall   mean %s  stddev %s\n", format_time(a, sizeof(a), mean), format_time(b, sizeof(b), stddev));
+    printf("         min %s  p50 %s  p95 %s  p99 %s  max %s\n", format_time(a, sizeof(a), wall[0]),
+           format_time(b, sizeof(b), percentile(wall, count, 50)), format_time(c, sizeof(c), percentile(wall, count, 95)),
+           format_time(d, sizeof(d), percentile(wall, count, 99)), format_time(e, sizeof(e), wall[count - 1]));
+    printf("  user   mean %s  sys mean %s\n", format_time(a, sizeof(a), user / count), format_time(b, sizeof(b), sys / count));
+    printf("  spawn  p50 %s  p95 %s  p99 %s  (shell, fork to last stage started)\n",
+           format_time(a, sizeof(a), percentile(spawn, count, 50)), format_time(b, sizeof(b), percentile(spawn, count, 95)),
+           format_time(c, sizeof(c), percentile(spawn, count, 99)));
+
+    if (shell_outliers + command_outliers > 0)
+        printf("  outliers: %d from the shell, %d from the command\n", shell_outliers, command_outliers);
+
+    free(wall);
+    free(spawn);
+}
+
+/* --------------------------------------- RUNNING --------------------------------------- */
+// Run the pipeline attr->bench_warmup times, then attr->bench_runs times measured, and
+// report the timings. Returns the last run's exit status, or -1 on error
+int bench_pipeline(int argc, char **pipeline[], const pipe_link_t *links, redirect_t *redirects, int redirect_count,
+                   substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr)
+{
+    int runs = attr->bench_runs,
+        warmup = attr->bench_warmup;
+    int saved_stdout = -1, status = EXIT_SUCCESS, failed = 0, measured = 0;
+
+    sample_t *samples = malloc(runs * sizeof(*samples));
+
+    if (!samples)
+    {
+        perror("malloc() failed");
+        return -1;
+    }
+
+    // [-q] The runs write to /dev/null, the report still goes to the shell's STDOUT
+    if (attr->bench_quiet)
+    {
+        int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+        fflush(stdout);
+
+        if (null == -1 || (saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0)) == -1 ||
+            dup2(null, STDOUT_FILENO) == -1)
+        {
+            perror("bench: /dev/null");
+
+            if (null != -1)
+                close(null);
+
+            if (saved_stdout != -1)
+                close(saved_stdout);
+
+            free(samples);
+            return -1;
+        }
+
+        close(null);
+    }
+
+    for (int i = 0; i < warmup + runs; i++)
+    {
+        pipeline_stats_t stats = {0};
+
+        attr->stats = i < warmup ? NULL : &stats;
+
+        // Each run gets a cgroup of its own, only the last one is reported
+        limits_release(attr);
+
+        double started = bench_clock();
+        // [bench memo ...] measures the cache: the first run fills it, the others replay it
+        if (attr->memo)
+            status = memo_pipeline(argc, pipeline, links, redirects, redirect_count, substitutions, substitution_count, attr);
+        else
+            status = execute_pipeline(argc, pipeline, links, false, redirects, redirect_count, substitutions, substitution_count, attr);
+        double finished = bench_clock();
+
+        // The shell could not run the pipeline, or the user interrupted it
+        if (status == -1 || status == 128 + SIGINT)
+            break;
+
+        if (i < warmup)
+            continue;
+
+        failed += status != EXIT_SUCCESS;
+        samples[measured++] = (sample_t){finished - started, stats.spawn, seconds(stats.usage.ru_utime), seconds(stats.usage.ru_stime)};
+    }
+
+    attr->stats = NULL;
+
+    if (saved_stdout != -1)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    limits_report(attr);
+
+    if (measured > 0)
+        report(samples, measured, warmup, failed);
+
+    free(samples);
+    return status;
+}
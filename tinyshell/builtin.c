@@ -5,12 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/wait.h>
+#include "tinyshell.h"
 
 /* -------------------------------------- CONSTANTS -------------------------------------- */
-#define BUILTIN_COMMANDS 4
+#define BUILTIN_COMMANDS 11
+#define SHELL_OPTIONS 5
 
 /* ------------------------------------- ANSI COLORS ------------------------------------- */
 #define ANSI_TITLE "\e[0;33m"
@@ -26,13 +30,138 @@ typedef struct
 {
     char *name;
     builtin_function_t function;
+    bool threaded; // Only reads shell state, so it may run on a thread as a pipeline stage
 } builtin_command_t;
 
+// Single shell option, toggled with [set -o name] / [set +o name]
+// Options taking an argument ([set -o name=argument]) are changed through change()
+typedef struct
+{
+    char *name;
+    bool *value;
+    int (*change)(bool enable, char *argument);
+} shell_option_t;
+
+/* ------------------------------------ SHELL OPTIONS ------------------------------------ */
+bool option_errexit = false;
+bool option_pipefail = false;
+bool option_trace = false;
+bool option_inprocess = true;
+
+// [set -o trace=FILE] / [set +o trace]
+static int change_trace(bool enable, char *argument)
+{
+    if (!enable)
+    {
+        trace_stop();
+        option_trace = false;
+        return EXIT_SUCCESS;
+    }
+
+    if (argument == NULL)
+    {
+        fprintf(stderr, "set: trace: file required ([set -o trace=FILE])\n");
+        return EXIT_FAILURE;
+    }
+
+    if (trace_start(argument) == -1)
+        return EXIT_FAILURE;
+
+    option_trace = true;
+    return EXIT_SUCCESS;
+}
+
+// [set -o scrollback[=SIZE]] / [set +o scrollback]
+static int change_scrollback(bool enable, char *argument)
+{
+    if (enable && argument)
+    {
+        long long size = parse_size(argument, true);
+
+        if (size <= 0)
+        {
+            fprintf(stderr, "set: scrollback: invalid size [%s]\n", argument);
+            return EXIT_FAILURE;
+        }
+
+        scrollback_limit(size);
+    }
+
+    option_scrollback = enable;
+    return EXIT_SUCCESS;
+}
+
+// The rc snapshot saves each option by its index here, a change to the list needs a new
+// SNAPSHOT_VERSION (rc.c)
+shell_option_t option_list[SHELL_OPTIONS] =
+    {
+        {"errexit", &option_errexit, NULL},
+        {"pipefail", &option_pipefail, NULL},
+        {"trace", &option_trace, &change_trace},
+        {"scrollback", &option_scrollback, &change_scrollback},
+        {"inprocess", &option_inprocess, NULL},
+};
+
+_Static_assert(SHELL_OPTIONS <= 32, "options_saved() holds one bit per option");
+
+// Every option as a bit mask in the order of option_list, saved by the rc snapshot (rc.c)
+uint32_t options_saved(void)
+{
+    uint32_t mask = 0;
+
+    for (int i = 0; i < SHELL_OPTIONS; i++)
+    {
+        if (*option_list[i].value)
+            mask |= 1u << i;
+    }
+
+    return mask;
+}
+
+// Restore options_saved(). trace is left alone, it owns a file which is never snapshotted
+void options_restore(uint32_t mask)
+{
+    for (int i = 0; i < SHELL_OPTIONS; i++)
+    {
+        if (option_list[i].value != &option_trace)
+            *option_list[i].value = mask & (1u << i);
+    }
+}
+
 /* ----------------------------------- BUILTIN COMMANDS ---------------------------------- */
-// [exit]
+// STDOUT of a builtin running on a thread as a pipeline stage, NULL for the shell's stdout
+_Thread_local FILE *builtin_output = NULL;
+
+// [exit [STATUS]], a STATUS which is not a number is an error and the shell keeps running
 int exit_builtin(char **args)
 {
-    exit(EXIT_SUCCESS);
+    if (args[1] != NULL)
+    {
+        char *end;
+        errno = 0;
+        long status = strtol(args[1], &end, 10);
+
+        if (end == args[1] || *end != '\0' || errno == ERANGE)
+        {
+            fprintf(stderr, "exit: %s: numeric argument required\n", args[1]);
+            return EXIT_SYNTAX_ERROR;
+        }
+
+        exit(status & 0xff);
+    }
+
+    exit(last_status);
+}
+
+// Record the current directory in the frecency database, after a successful [cd] or [z]
+static void record_cwd(void)
+{
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)))
+    {
+        frecency_visit(cwd);
+    }
 }
 
 // [cd]
@@ -42,7 +171,8 @@ int cd_builtin(char **args)
     {
         if (args[1] == NULL || strcmp(args[1], "~") == 0)
         {
-            chdir(getenv("HOME"));
+            if (chdir(getenv("HOME")) == 0)
+                record_cwd();
         }
 
         else if (chdir(args[1]) == -1)
@@ -50,6 +180,11 @@ int cd_builtin(char **args)
             printf("cd: %s: No such file or directory\n", args[1]);
             return EXIT_FAILURE;
         }
+
+        else
+        {
+            record_cwd();
+        }
     }
 
     return EXIT_SUCCESS;
@@ -58,11 +193,12 @@ int cd_builtin(char **args)
 // [cwd]
 int cwd_builtin(char **args)
 {
+    FILE *out = builtin_output ? builtin_output : stdout;
     char cwd[128];
 
     if (getcwd(cwd, 128))
     {
-        printf("%s\n", cwd);
+        fprintf(out, "%s\n", cwd);
     }
 
     else
@@ -77,69 +213,350 @@ int cwd_builtin(char **args)
 // [ver]
 int ver_builtin(char **args)
 {
-    printf("@------------@" ANSI_TITLE " TINY SHELL " ANSI_COLOR_RESET "@------------@" ANSI_COLOR_RESET "\n");
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf("%-20s%18s", " Author:", "Matthew Kenely ");
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    FILE *out = builtin_output ? builtin_output : stdout;
+
+    fprintf(out, "@------------@" ANSI_TITLE " TINY SHELL " ANSI_COLOR_RESET "@------------@" ANSI_COLOR_RESET "\n");
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, "%-20s%18s", " Author:", "Matthew Kenely ");
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf("%-20s%18s", " Version:", "1.0 ");
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, "%-20s%18s", " Version:", "1.0 ");
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf("%-20s%18s", " ", " ");
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, "%-20s%18s", " ", " ");
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf(ANSI_QUOTE " But, use this, to summon one another " ANSI_COLOR_RESET);
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_QUOTE " But, use this, to summon one another " ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf(ANSI_QUOTE " as spirits, cross the gaps between   " ANSI_COLOR_RESET);
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_QUOTE " as spirits, cross the gaps between   " ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf(ANSI_QUOTE " the worlds, and engage in jolly      " ANSI_COLOR_RESET);
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_QUOTE " the worlds, and engage in jolly      " ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
-    printf(ANSI_QUOTE " co-operation!                        " ANSI_COLOR_RESET);
-    printf(ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|" ANSI_COLOR_RESET);
+    fprintf(out, ANSI_QUOTE " co-operation!                        " ANSI_COLOR_RESET);
+    fprintf(out, ANSI_COLOR_RESET "|\n" ANSI_COLOR_RESET);
 
-    printf(ANSI_COLOR_RESET "@--------------------------------------@" ANSI_COLOR_RESET "\n");
+    fprintf(out, ANSI_COLOR_RESET "@--------------------------------------@" ANSI_COLOR_RESET "\n");
 
     return EXIT_SUCCESS;
 }
 
-builtin_command_t builtin_list[BUILTIN_COMMANDS] =
+// [set]
+int set_builtin(char **args)
+{
+    // No arguments, list options
+    if (args[1] == NULL)
     {
-        {"exit", &exit_builtin},
-        {"cd", &cd_builtin},
-        {"cwd", &cwd_builtin},
-        {"ver", &ver_builtin},
-};
+        for (int i = 0; i < SHELL_OPTIONS; i++)
+        {
+            printf("%-16s%s\n", option_list[i].name, *option_list[i].value ? "on" : "off");
+        }
 
-int execute_builtin(char *name, char **args, bool async)
+        return EXIT_SUCCESS;
+    }
+
+    for (int a = 1; args[a] != NULL; a++)
+    {
+        bool enable = args[a][0] == '-';
+        char *name = NULL;
+
+        if ((args[a][0] != '-' && args[a][0] != '+') || args[a][1] == '\0')
+        {
+            fprintf(stderr, "set: %s: invalid option\n", args[a]);
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(args[a] + 1, "e") == 0)
+        {
+            name = "errexit";
+        }
+
+        else if (strcmp(args[a] + 1, "o") == 0)
+        {
+            name = args[++a];
+
+            if (name == NULL)
+            {
+                fprintf(stderr, "set: %s: option name required\n", args[a - 1]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        else
+        {
+            fprintf(stderr, "set: %s: invalid option\n", args[a]);
+            return EXIT_FAILURE;
+        }
+
+        // [name=argument]
+        char *argument = strchr(name, '=');
+        size_t name_length = argument ? (size_t)(argument - name) : strlen(name);
+
+        if (argument)
+            argument++;
+
+        shell_option_t *option = NULL;
+
+        for (int i = 0; i < SHELL_OPTIONS; i++)
+        {
+            if (strncmp(option_list[i].name, name, name_length) == 0 && option_list[i].name[name_length] == '\0')
+            {
+                option = &option_list[i];
+                break;
+            }
+        }
+
+        if (!option)
+        {
+            fprintf(stderr, "set: %s: invalid option name\n", name);
+            return EXIT_FAILURE;
+        }
+
+        if (option->change)
+        {
+            if (option->change(enable, argument) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+        }
+
+        else if (argument)
+        {
+            fprintf(stderr, "set: %.*s: option takes no argument\n", (int)name_length, name);
+            return EXIT_FAILURE;
+        }
+
+        else
+        {
+            *option->value = enable;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// [wait]
+int wait_builtin(char **args)
 {
-    bool found = false;
+    return supervisor_wait_all();
+}
 
-    for (int i = 0; i < BUILTIN_COMMANDS; i++)
+// [export NAME=VALUE ...]
+int export_builtin(char **args)
+{
+    extern char **environ;
+
+    // No arguments, list the environment
+    if (args[1] == NULL)
+    {
+        for (char **variable = environ; *variable; variable++)
+        {
+            printf("export %s\n", *variable);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    for (int a = 1; args[a] != NULL; a++)
     {
-        int min_length = sizeof(name) <= sizeof(builtin_list[i].name) ? sizeof(name) : sizeof(builtin_list[i].name);
+        char *equals = strchr(args[a], '=');
 
-        if (strncmp(builtin_list[i].name, name, min_length) == 0)
+        if (!equals || equals == args[a])
         {
-            found = true;
-            builtin_list[i].function(args);
-            return EXIT_SUCCESS;
+            fprintf(stderr, "export: %s: expected NAME=VALUE\n", args[a]);
+            return EXIT_FAILURE;
         }
+
+        *equals = '\0';
+
+        if (setenv(args[a], equals + 1, 1) == -1)
+        {
+            perror("export: setenv() failed");
+            return EXIT_FAILURE;
+        }
+
+        rc_note_export(args[a]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// [alias name=value ...], [alias name] prints a single alias
+int alias_builtin(char **args)
+{
+    // No arguments, list aliases
+    if (args[1] == NULL)
+    {
+        alias_print(NULL);
+        return EXIT_SUCCESS;
     }
 
-    if (!found)
+    for (int a = 1; args[a] != NULL; a++)
     {
-        // No error message, all commands are run through this function
+        char *equals = strchr(args[a], '=');
+
+        if (!equals)
+        {
+            if (!alias_lookup(args[a]))
+            {
+                fprintf(stderr, "alias: %s: not found\n", args[a]);
+                return EXIT_FAILURE;
+            }
+
+            alias_print(args[a]);
+            continue;
+        }
+
+        if (equals == args[a])
+        {
+            fprintf(stderr, "alias: %s: expected name=value\n", args[a]);
+            return EXIT_FAILURE;
+        }
+
+        *equals = '\0';
+
+        if (alias_set(args[a], equals + 1) == -1)
+        {
+            perror("alias: malloc() failed");
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// [z pattern...] jumps to the best ranked directory matching every pattern in order
+// [z -l pattern...] lists the matching directories, [z] lists every directory
+int z_builtin(char **args)
+{
+    if (args[1] == NULL || strcmp(args[1], "-l") == 0)
+    {
+        frecency_list(args[1] ? args + 2 : args + 1);
+        return EXIT_SUCCESS;
+    }
+
+    const char *best = frecency_best(args + 1);
+
+    if (!best)
+    {
+        fprintf(stderr, "z: no match\n");
         return EXIT_FAILURE;
     }
 
+    if (chdir(best) == -1)
+    {
+        fprintf(stderr, "z: ");
+        perror(best);
+        return EXIT_FAILURE;
+    }
+
+    record_cwd();
     return EXIT_SUCCESS;
 }
+
+// [last [n]] replays the output of the nth most recent command captured by scrollback
+// [last -g pattern [n]] only replays the lines containing pattern, [last -l] lists commands
+int last_builtin(char **args)
+{
+    const char *pattern = NULL;
+    int a = 1;
+
+    if (args[a] && strcmp(args[a], "-l") == 0)
+    {
+        scrollback_list();
+        return EXIT_SUCCESS;
+    }
+
+    if (args[a] && strcmp(args[a], "-g") == 0)
+    {
+        if (!(pattern = args[++a]))
+        {
+            fprintf(stderr, "last: -g: pattern required\n");
+            return EXIT_FAILURE;
+        }
+
+        a++;
+    }
+
+    int n = args[a] ? atoi(args[a]) : 1;
+
+    if (scrollback_replay(n, pattern) == -1)
+    {
+        fprintf(stderr, "last: %s: no such command%s\n", args[a] ? args[a] : "1",
+                option_scrollback ? "" : " (enable with [set -o scrollback])");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// [memo] shows the cache's hit and miss counts, [memo -C] empties it
+// ([memo command ...] is a prefix, handled in memo.c)
+int memo_builtin(char **args)
+{
+    if (args[1] && strcmp(args[1], "-C") == 0)
+        return memo_clear() == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    memo_stats();
+    return EXIT_SUCCESS;
+}
+
+builtin_command_t builtin_list[BUILTIN_COMMANDS] =
+    {
+        {"exit", &exit_builtin, false},
+        {"cd", &cd_builtin, false},
+        {"cwd", &cwd_builtin, true},
+        {"ver", &ver_builtin, true},
+        {"set", &set_builtin, false},
+        {"wait", &wait_builtin, false},
+        {"export", &export_builtin, false},
+        {"alias", &alias_builtin, false},
+        {"z", &z_builtin, false},
+        {"last", &last_builtin, false},
+        {"memo", &memo_builtin, false},
+};
+
+// Returns the builtin's exit status, or BUILTIN_NOT_FOUND if name is not a builtin
+int execute_builtin(char *name, char **args, bool async)
+{
+    for (int i = 0; i < BUILTIN_COMMANDS; i++)
+    {
+        if (strcmp(builtin_list[i].name, name) == 0)
+        {
+            return builtin_list[i].function(args);
+        }
+    }
+
+    // No error message, all commands are run through this function
+    return BUILTIN_NOT_FOUND;
+}
+
+// Whether name is a builtin
+bool builtin_exists(const char *name)
+{
+    for (int i = 0; i < BUILTIN_COMMANDS; i++)
+    {
+        if (strcmp(builtin_list[i].name, name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Whether name is a builtin which may run on a thread as a pipeline stage
+bool builtin_threaded(const char *name)
+{
+    for (int i = 0; i < BUILTIN_COMMANDS; i++)
+    {
+        if (strcmp(builtin_list[i].name, name) == 0)
+            return builtin_list[i].threaded;
+    }
+
+    return false;
+}
@@ -1,160 +1,722 @@
 /* -------------------------------------- execute.c  -------------------------------------- */
 /* Provides the execute_pipeline() function, a modification of execute_pipeline_async_ex(). */
 /* Automatically acts as a fork_exec() function, omitting the piping process when passed a  */
-/* single command as an argument.                                                           */
+/* single command as an argument. Every stage is forked before any of them is waited on.    */
+/* Stages are registered as a job with the event loop in supervisor.c, which reaps them;    */
+/* the exit status of each stage is then recorded in pipe_status[].                         */
+/* Descriptors created by the shell are close-on-exec, and each child closes everything     */
+/* above the descriptors it uses, so commands only inherit their own STDIN/STDOUT/STDERR.   */
+/* Stages which can run inside the shell are started on threads instead, see inprocess.c;   */
+/* other builtins in a pipeline run in their forked child, as they would in a subshell.     */
+/* A child which cannot run its command writes the failing step and errno to a close-on-    */
+/* exec pipe and _exit()s; the shell reads EOF once execvp() succeeds. The pipes are read   */
+/* once every stage has been forked, so stages start in parallel; on a failure the error is */
+/* reported and the rest of the pipeline is terminated.                                     */
+
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include "tinyshell.h"
 
-int execute_pipeline(int argc, char **pipeline[], bool async, char *file_in, char *file_out, bool append_out)
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Step of a child's setup which failed
+typedef enum
+{
+    SPAWN_DUP2,         // Binding pipes to STDIN/STDOUT/STDERR
+    SPAWN_REDIRECT,     // The stage's own redirections
+    SPAWN_SUBSTITUTION, // Keeping the process substitutions' descriptors
+    SPAWN_LIMITS,       // Resource limits
+    SPAWN_SCHED,        // Scheduling attributes
+    SPAWN_EXEC          // execvp()
+} spawn_step_t;
+
+// Written by a child to its report pipe when it cannot run its command. The pipe is
+// close-on-exec, so the shell reads EOF instead once execvp() has succeeded
+typedef struct
+{
+    spawn_step_t step;
+    int error;    // errno
+    int redirect; // Index of the failing redirection, for SPAWN_REDIRECT
+} spawn_error_t;
+
+// Report pipes of the forked stages, read once every stage has been forked
+typedef struct
+{
+    int *fds;        // Read end for each stage, -1 once read or if the stage has none
+    char ***args;    // The pipeline's commands
+    int count;       // Stages forked so far
+    redirect_t *redirects;
+} spawn_reports_t;
+
+/* ------------------------------------- EXIT STATUS ------------------------------------- */
+int last_status = EXIT_SUCCESS;
+int *pipe_status = NULL;
+int pipe_status_count = 0;
+static int pipe_status_capacity = 0;
+
+// Record the statuses of every stage of the last pipeline as ${PIPESTATUS[n]}
+int record_status(const int *statuses, int count)
+{
+    if (count > pipe_status_capacity)
+    {
+        int *grown = realloc(pipe_status, count * sizeof(*pipe_status));
+
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
+
+        pipe_status = grown;
+        pipe_status_capacity = count;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pipe_status[i] = statuses[i];
+    }
+
+    pipe_status_count = count;
+    return 0;
+}
+
+// Status of the whole pipeline: last stage, or rightmost failing stage with pipefail set
+static int pipeline_status(void)
+{
+    if (option_pipefail)
+    {
+        for (int i = pipe_status_count - 1; i >= 0; i--)
+        {
+            if (pipe_status[i] != EXIT_SUCCESS)
+                return pipe_status[i];
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    return pipe_status_count > 0 ? pipe_status[pipe_status_count - 1] : EXIT_SUCCESS;
+}
+
+// Wait for every started stage of a foreground job, record their statuses and release it
+static int finish_job(job_t *job, pipeline_attr_t *attr)
+{
+    int waited = supervisor_wait(job, -1);
+
+    if (record_status(job->status, job->count) == -1)
+        waited = -1;
+
+    // [bench] reports the cgroup of its last run once, after the loop
+    if (attr && attr->bench_runs == 0)
+        limits_report(attr);
+
+    if (attr && attr->stats)
+        attr->stats->usage = job->usage;
+
+    job_free(job);
+
+    return waited;
+}
+
+// Abandon a pipeline whose setup failed after some stages were started
+static int abort_job(job_t *job, pipeline_attr_t *attr)
+{
+    if (job->background)
+    {
+        supervisor_wait(job, -1);
+        return -1;
+    }
+
+    finish_job(job, attr);
+    return -1;
+}
+
+/* ------------------------------------ SPAWN ERRORS ------------------------------------- */
+static const char *spawn_steps[] = {"dup2()", "redirection", "keep_substitutions()", "limits_apply()", "sched_apply()", "execvp()"};
+
+// Print why a stage could not be started
+static void spawn_report(const spawn_error_t *report, char **args, redirect_t *redirects)
+{
+    if (report->step == SPAWN_REDIRECT)
+        redirect_error(&redirects[report->redirect], report->error);
+    else if (report->step == SPAWN_EXEC && report->error == ENOENT)
+        fprintf(stderr, "tinyshell: %s: command not found\n", args[0]);
+    else if (report->step == SPAWN_EXEC)
+        fprintf(stderr, "tinyshell: %s: %s\n", args[0], strerror(report->error));
+    else
+        fprintf(stderr, "tinyshell: %s: %s failed: %s\n", args[0], spawn_steps[report->step], strerror(report->error));
+}
+
+// Called in the child: report the failing step to the shell and exit, so the child never
+// returns into the shell's own code. Without a report pipe the child prints it itself
+static _Noreturn void spawn_failed(int report_fd, spawn_step_t step, int redirect, char **args, redirect_t *redirects)
+{
+    spawn_error_t report = {step, errno, redirect};
+
+    if (report_fd == -1 || write(report_fd, &report, sizeof(report)) != sizeof(report))
+        spawn_report(&report, args, redirects);
+
+    // 127: command not found, 126: found but not executable
+    if (step == SPAWN_EXEC)
+        _exit(report.error == ENOENT ? 127 : 126);
+
+    _exit(EXIT_FAILURE);
+}
+
+// Wait for each forked stage to exec, or to report why it could not. Every stage is forked
+// before any report is read, so stages start in parallel
+static void collect_reports(spawn_reports_t *reports)
+{
+    for (int i = 0; i < reports->count; i++)
+    {
+        spawn_error_t failure;
+        ssize_t reported;
+
+        if (reports->fds[i] == -1)
+            continue;
+
+        while ((reported = read(reports->fds[i], &failure, sizeof(failure))) == -1 && errno == EINTR)
+            ;
+
+        close(reports->fds[i]);
+        reports->fds[i] = -1;
+
+        if (reported == sizeof(failure))
+            spawn_report(&failure, reports->args[i], reports->redirects);
+    }
+}
+
+// Move the report pipe above every descriptor the stage redirects, so none replaces it
+static int report_above(int report_fd, redirect_t *redirects, int count, int stage)
+{
+    int highest = STDERR_FILENO;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (redirects[i].stage == stage && redirects[i].fd > highest)
+            highest = redirects[i].fd;
+    }
+
+    return report_fd == -1 || report_fd > highest ? report_fd : fcntl(report_fd, F_DUPFD_CLOEXEC, highest + 1);
+}
+
+// Whether a redirection of stage opens a FIFO. Opening it may block until another command
+// opens the other end, so the shell cannot wait for the stage to exec
+static bool opens_fifo(redirect_t *redirects, int count, int stage)
+{
+    struct stat st;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (redirects[i].stage == stage && redirects[i].path && stat(redirects[i].path, &st) == 0 && S_ISFIFO(st.st_mode))
+            return true;
+    }
+
+    return false;
+}
+
+// Reset attributes to "no prefix given"
+void init_attr(pipeline_attr_t *attr)
+{
+    attr->rlimit_count = 0;
+    attr->memory_max = attr->cpu_quota = attr->pids_max = -1;
+    attr->cgroup[0] = '\0';
+
+    init_sched(&attr->sched);
+    attr->stage_sched = NULL;
+    attr->spread = false;
+
+    attr->timeout = 0;
+    attr->grace = 0;
+
+    attr->bench_runs = attr->bench_warmup = 0;
+    attr->bench_quiet = false;
+    attr->stats = NULL;
+
+    attr->memo = false;
+    attr->memo_env_count = 0;
+}
+
+// Hand the terminal to process group pgid, SIGTTOU is blocked since the caller may be in
+// the background at the time
+static void set_foreground(pid_t pgid)
+{
+    sigset_t block, previous;
+
+    if (!isatty(STDIN_FILENO))
+        return;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &previous);
+
+    tcsetpgrp(STDIN_FILENO, pgid);
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+}
+
+// Close the shell's ends of a pipe, an end handed to an in-process stage is -1
+static int close_pipe(int pipe_fd[2])
+{
+    int closed = 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (pipe_fd[i] != -1 && close(pipe_fd[i]) == -1)
+            closed = -1;
+    }
+
+    return closed;
+}
+
+// Abandon a pipeline whose setup failed, after closing the shell's ends of its pipes
+static int abort_pipeline(job_t *job, pipeline_attr_t *attr, fanout_t *fanout, substitution_t *substitutions, int substitution_count,
+                          spawn_reports_t *reports)
+{
+    collect_reports(reports);
+    fanout_close(fanout);
+    close_substitutions(substitutions, substitution_count);
+    scrollback_started();
+
+    abort_job(job, attr);
+    scrollback_finish(EXIT_FAILURE);
+
+    return -1;
+}
+
+// Input and output of in-process stage, taking over the shell's pipe ends it uses
+// ring_in joins it to the previous stage, ring_out (if not NULL) to the next one
+static int stage_streams(int stage, int argc, bool piped_in, bool piped_out, int *previous_fd, int *current_fd,
+                         ring_t *ring_in, ring_t *ring_out, const int capture[2], stream_t *in, stream_t *out)
+{
+    *in = (stream_t){-1, ring_in, false};
+    *out = (stream_t){-1, ring_out, false};
+
+    if (!piped_in)
+    {
+        in->fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+
+    else if (!ring_in)
+    {
+        in->fd = previous_fd[0];
+        previous_fd[0] = -1;
+    }
+
+    if (piped_out && !ring_out)
+    {
+        out->fd = current_fd[1];
+        current_fd[1] = -1;
+    }
+
+    else if (!piped_out)
+    {
+        out->fd = fcntl(stage == argc - 1 && capture[0] != -1 ? capture[0] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+
+    if ((!in->ring && in->fd == -1) || (!out->ring && out->fd == -1))
+    {
+        perror("fcntl() failed");
+        stream_close(in, false);
+        stream_close(out, true);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Replace the shell with a single external command, once nothing is left for it to do
+// Pending frecency visits are saved first, the exit status is the command's
+_Noreturn void execute_in_place(char **args, redirect_t *redirects, int redirect_count)
+{
+    int max_fd = STDERR_FILENO, failed = -1;
+
+    frecency_flush();
+    fflush(stdout);
+    supervisor_child_reset();
+
+    if (apply_redirects(redirects, redirect_count, 0, &max_fd, &failed) == -1)
+        spawn_failed(-1, SPAWN_REDIRECT, failed, args, redirects);
+
+    close_inherited(max_fd + 1);
+
+    execvp(*args, args);
+    spawn_failed(-1, SPAWN_EXEC, -1, args, redirects);
+}
+
+// Returns the pipeline's exit status, or -1 if the shell failed to set it up
+// links[i] joins stage i to the previous one, links may be NULL for a linear chain
+// attr may be NULL when the pipeline has no prefix attributes
+int execute_pipeline(int argc, char **pipeline[], const pipe_link_t *links, bool async, redirect_t *redirects, int redirect_count,
+                     substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr)
 {
-    int fd[(argc - 1) * 2];
+    int fd[argc * 2];
     int *current_fd = fd,
         *previous_fd = NULL;
 
+    pid_t cpid[argc];
+    inprocess_fn_t inprocess[argc]; // Stages run on a thread, NULL for forked stages
+    ring_t *ring_in = NULL;         // Joins the stage to the previous one, if both run in-process
+    pid_t pgid = 0; // Process group of a timed pipeline, the first stage's pid
+
+    bool own_group = attr && attr->timeout > 0 && !async;
+    int timed_out = 0;
+
     int stage = 0;
+    fanout_t fanout;
+    int capture[2] = {-1, -1}; // Last stage's STDOUT and STDERR, when kept for scrollback
+
+    int report_fds[argc];
+    spawn_reports_t reports = {report_fds, pipeline, 0, redirects};
+
+    for (int i = 0; i < argc; i++)
+    {
+        report_fds[i] = -1;
+    }
+
+    double started = attr && attr->stats ? bench_clock() : 0;
+
+    if (async && attr && attr->timeout > 0)
+    {
+        fprintf(stderr, "timeout: ignored for background pipelines\n");
+    }
+
+    trace_begin_pipeline();
+
+    // Create the pipeline's cgroup before any stage is forked into it
+    if (attr && limits_prepare(attr) == -1)
+    {
+        return -1;
+    }
+
+    job_t *job = job_create(argc, async);
+
+    if (!job)
+    {
+        perror("job_create() failed");
+
+        if (attr)
+            limits_release(attr);
+
+        return -1;
+    }
+
+    // Background jobs report their cgroup once done, so keep a copy of the attributes
+    if (async && attr && attr->cgroup[0] != '\0' && (job->attr = malloc(sizeof(*attr))))
+    {
+        *job->attr = *attr;
+        attr->cgroup[0] = '\0';
+    }
+
+    // Fan-out: the process copying the producer's output to each branch
+    if (fanout_start(job, &fanout, links, argc) == -1)
+    {
+        return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
+    }
+
+    // Process substitutions run alongside the stages, their paths are needed in argv first
+    if (start_substitutions(job, substitutions, substitution_count, redirects, redirect_count) == -1)
+    {
+        return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
+    }
+
+    // Scrollback: the last stage of a foreground pipeline writes through the shell
+    if (!async)
+    {
+        scrollback_start(argc, pipeline, capture);
+    }
+
+    inprocess_plan(inprocess, argc, pipeline, links, async, redirects, redirect_count, substitutions, substitution_count, attr);
 
     while (stage < argc)
     {
+        // Stages joined by [|*] are connected through the fan-out process instead
+        bool piped_in = stage > 0 && (!links || links[stage] == LINK_PIPE),
+             piped_out = stage < argc - 1 && (!links || links[stage + 1] == LINK_PIPE);
+
+        // Two in-process stages are joined by a ring instead of a pipe
+        bool ring_out = piped_out && inprocess[stage] && inprocess[stage + 1];
+        ring_t *ring = NULL;
+
         previous_fd = current_fd - 2;
+        current_fd[0] = current_fd[1] = -1;
 
-        if (stage < argc - 1)
+        if (ring_out && !(ring = ring_create()))
         {
-            if (pipe(current_fd) == -1)
-            {
-                perror("pipe() failed");
-                return EXIT_FAILURE;
-            }
-        }
+            perror("ring_create() failed");
 
-        pid_t cpid = fork();
+            if (ring_in)
+                ring_close(ring_in, false);
 
-        if (cpid == -1)
-        {
-            perror("fork() failed");
-            return EXIT_FAILURE;
+            if (piped_in)
+                close_pipe(previous_fd);
+
+            return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
         }
 
-        /* CHILD PROCESS */
-        if (cpid == 0)
+        if (piped_out && !ring_out)
         {
-            // First stage
-            if (stage == 0 && file_in)
+            // Close-on-exec, so later stages and unrelated commands never hold the pipe open
+            if (pipe2(current_fd, O_CLOEXEC) == -1)
             {
-                if (redirect_input(file_in) == -1)
-                {
-                    perror("redirect_input() failed");
-                    return EXIT_FAILURE;
-                }
+                perror("pipe2() failed");
+
+                if (piped_in)
+                    close_pipe(previous_fd);
+
+                return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
             }
+        }
+
+        // In-process stage: started on a thread, which owns its ends of the pipes and rings
+        if (inprocess[stage])
+        {
+            stream_t in, out;
 
-            // All stages except last
-            if (stage < argc - 1)
+            if (stage_streams(stage, argc, piped_in, piped_out, previous_fd, current_fd, ring_in, ring, capture, &in, &out) == -1 ||
+                inprocess_start(job, stage, inprocess[stage], *pipeline, in, out) == -1)
             {
-                if (close(current_fd[0]) == -1) // Close read
-                {
-                    perror("close() failed");
-                    return EXIT_FAILURE;
-                }
-
-                if (dup2(current_fd[1], STDOUT_FILENO) == -1) // Bind STDOUT to write-end
-                {
-                    perror("dup2() failed");
-                    return EXIT_FAILURE;
-                }
-
-                if (close(current_fd[1]) == -1)
-                {
-                    perror("close() failed");
-                    return EXIT_FAILURE;
-                }
+                if (ring)
+                    ring_close(ring, false);
+
+                if (piped_out)
+                    close_pipe(current_fd);
+
+                if (piped_in)
+                    close_pipe(previous_fd);
+
+                return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
             }
 
-            // Last stage
-            if (stage == argc - 1 && file_out)
+            if (piped_in && close_pipe(previous_fd) == -1)
             {
-                int out_return = append_out ? redirect_output(file_out, O_RDWR | O_APPEND) : redirect_output(file_out, O_RDWR | O_TRUNC);
-                if (out_return == -1)
-                {
-                    perror("redirect_output() failed");
-                    return EXIT_FAILURE;
-                }
+                perror("close() failed");
+                return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
             }
 
-            // All stages except first
-            if (stage > 0)
+            ring_in = ring;
+            pipeline++;
+            stage++;
+            current_fd += 2;
+            continue;
+        }
+
+        // Compressed redirections: helper threads (de)compress through a pipe the stage inherits
+        // A file which cannot be opened fails the stage as [<] would, no later stage starts
+        if (start_compressed(job, redirects, redirect_count, stage) == -1)
+        {
+            close_compressed(redirects, redirect_count, stage);
+            job->status[stage] = EXIT_FAILURE;
+            job->count = stage + 1;
+
+            if (piped_out)
+                close_pipe(current_fd);
+
+            if (piped_in)
+                close_pipe(previous_fd);
+
+            break;
+        }
+
+        // Report pipe: the child writes why it could not run its command, EOF means it exec'd
+        int report[2] = {-1, -1};
+
+        if (!opens_fifo(redirects, redirect_count, stage) && pipe2(report, O_CLOEXEC) == -1)
+        {
+            perror("pipe2() failed");
+            close_compressed(redirects, redirect_count, stage);
+
+            if (piped_out)
+                close_pipe(current_fd);
+
+            if (piped_in)
+                close_pipe(previous_fd);
+
+            return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
+        }
+
+        uint64_t forked = trace_clock();
+
+        cpid[stage] = fork();
+
+        if (cpid[stage] == -1)
+        {
+            perror("fork() failed");
+            close_compressed(redirects, redirect_count, stage);
+
+            if (report[0] != -1)
+                close_pipe(report);
+
+            if (piped_out)
+                close_pipe(current_fd);
+
+            if (piped_in)
+                close_pipe(previous_fd);
+
+            return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
+        }
+
+        /* CHILD PROCESS */
+        if (cpid[stage] == 0)
+        {
+            int report_fd = report_above(report[1], redirects, redirect_count, stage);
+
+            supervisor_child_reset();
+
+            // Timed pipelines run in their own process group, which owns the terminal
+            if (own_group)
             {
-                if (close(previous_fd[1]) == -1) // Close write
-                {
-                    perror("close() failed");
-                    return EXIT_FAILURE;
-                }
-
-                if (dup2(previous_fd[0], STDIN_FILENO) == -1) // Bind STDIN to read-end
-                {
-                    perror("dup2() failed");
-                    return EXIT_FAILURE;
-                }
-
-                if (close(previous_fd[0]) == -1)
-                {
-                    perror("close() failed");
-                    return EXIT_FAILURE;
-                }
+                setpgid(0, pgid);
+
+                if (stage == 0)
+                    set_foreground(getpid());
             }
 
-            if (execvp(**pipeline, *pipeline) == -1)
+            // All stages except last: bind STDOUT to the write-end
+            if (piped_out && dup2(current_fd[1], STDOUT_FILENO) == -1)
+                spawn_failed(report_fd, SPAWN_DUP2, -1, *pipeline, redirects);
+
+            // All stages except first: bind STDIN to the read-end
+            if (piped_in && dup2(previous_fd[0], STDIN_FILENO) == -1)
+                spawn_failed(report_fd, SPAWN_DUP2, -1, *pipeline, redirects);
+
+            // Last stage: bind STDOUT and STDERR to the shell's capture pipes
+            if (stage == argc - 1 && capture[0] != -1 &&
+                (dup2(capture[0], STDOUT_FILENO) == -1 || dup2(capture[1], STDERR_FILENO) == -1))
+                spawn_failed(report_fd, SPAWN_DUP2, -1, *pipeline, redirects);
+
+            // Producer: bind STDOUT to the fan-out process, branches: bind STDIN to their copy
+            if (fanout_child(&fanout, stage) == -1)
+                spawn_failed(report_fd, SPAWN_DUP2, -1, *pipeline, redirects);
+
+            // The stage's own redirections, after the pipes so [2>&1] follows STDOUT into one
+            int max_fd = STDERR_FILENO, failed = -1;
+
+            if (apply_redirects(redirects, redirect_count, stage, &max_fd, &failed) == -1)
+                spawn_failed(report_fd, SPAWN_REDIRECT, failed, *pipeline, redirects);
+
+            if (keep_substitutions(substitutions, substitution_count, stage, &max_fd) == -1)
+                spawn_failed(report_fd, SPAWN_SUBSTITUTION, -1, *pipeline, redirects);
+
+            // The report pipe is kept just above the descriptors in use
+            if (report_fd != -1 && report_fd != max_fd + 1 && (report_fd = dup3(report_fd, max_fd + 1, O_CLOEXEC)) == -1)
+                spawn_failed(-1, SPAWN_DUP2, -1, *pipeline, redirects);
+
+            // Pipe ends and anything else above the descriptors in use are not inherited
+            close_inherited(report_fd != -1 ? report_fd + 1 : max_fd + 1);
+
+            // Resource limits
+            if (attr && limits_apply(attr) == -1)
+                spawn_failed(report_fd, SPAWN_LIMITS, -1, *pipeline, redirects);
+
+            // CPU affinity, nice, I/O priority and scheduling policy
+            if (attr && sched_apply(attr, stage) == -1)
+                spawn_failed(report_fd, SPAWN_SCHED, -1, *pipeline, redirects);
+
+            // Builtins which change shell state run in the child, like a subshell; the shell
+            // stops waiting for the report once it is closed
+            if (builtin_exists(**pipeline))
             {
-                perror("Execution failed");
-                exit(EXIT_FAILURE);
+                if (report_fd != -1)
+                    close(report_fd);
+
+                int status = execute_builtin(**pipeline, *pipeline, async);
+
+                fflush(stdout);
+                _exit(status);
             }
 
-            return EXIT_SUCCESS;
+            trace_record(trace_clock(), TRACE_EXEC, 0, stage, 0, NULL);
+
+            execvp(**pipeline, *pipeline);
+            spawn_failed(report_fd, SPAWN_EXEC, -1, *pipeline, redirects);
         }
 
         /* PARENT PROCESS */
-        if (stage >= 1)
-        {
-            if (close(previous_fd[0]) == -1 || close(previous_fd[1]) == -1)
-            {
-                perror("close() failed");
-                return EXIT_FAILURE;
-            }
-        }
+        trace_record(forked, TRACE_FORK, cpid[stage], stage, 0, **pipeline);
+        close_compressed(redirects, redirect_count, stage);
+
+        // The report is read once every stage has been forked, the child is reaped as usual
+        if (report[0] != -1)
+            close(report[1]);
+
+        report_fds[stage] = report[0];
+        reports.count = stage + 1;
 
-        // Block parent execution
-        int status;
-        if (!async)
+        if (job_add(job, stage, cpid[stage]) == -1)
         {
-            if (waitpid(cpid, &status, WUNTRACED) == -1)
-            {
-                perror("waitpid() failed");
-                return EXIT_FAILURE;
-            }
+            perror("job_add() failed");
         }
-        else
+
+        // Also set in the parent, so the group exists whichever process runs first
+        if (own_group)
         {
-            if (waitpid(cpid, &status, WNOHANG) == -1)
+            setpgid(cpid[stage], pgid);
+
+            if (stage == 0)
             {
-                perror("waitpid() failed");
-                return EXIT_FAILURE;
+                pgid = cpid[0];
+                set_foreground(pgid);
             }
         }
 
-        if (!WIFEXITED(status))
+        if (piped_in && close_pipe(previous_fd) == -1)
         {
-            return EXIT_FAILURE;
+            perror("close() failed");
+            return abort_pipeline(job, attr, &fanout, substitutions, substitution_count, &reports);
         }
 
+        ring_in = NULL;
         pipeline++;
         stage++;
         current_fd += 2;
     }
 
-    return EXIT_SUCCESS;
+    // A stage which could not run its command has exited with 127 (or 126) once its report
+    // is read; its neighbours see EOF or SIGPIPE on its closed pipe ends and finish as usual
+    collect_reports(&reports);
+
+    // Each stage holds its own ends of the fan-out and substitutions' pipes now
+    fanout_close(&fanout);
+    close_substitutions(substitutions, substitution_count);
+    scrollback_started();
+
+    if (attr && attr->stats)
+        attr->stats->spawn = bench_clock() - started;
+
+    // Background job: reaped by the event loop, reported by supervisor_notify()
+    if (async)
+    {
+        fprintf(stderr, "[%d] %d\n", job->id, job->pids[job->count - 1]);
+        return EXIT_SUCCESS;
+    }
+
+    // Timed pipeline: wait until the deadline, then signal the process group
+    if (own_group)
+    {
+        timed_out = wait_deadline(job, pgid, attr);
+    }
+
+    // Block parent execution until every stage has exited
+    int waited = finish_job(job, attr);
+
+    scrollback_finish(timed_out == 1 ? EXIT_TIMEOUT : pipeline_status());
+
+    if (own_group)
+        set_foreground(getpgrp());
+
+    if (waited == -1 || timed_out == -1)
+    {
+        return -1;
+    }
+
+    return timed_out == 1 ? EXIT_TIMEOUT : pipeline_status();
 }
@@ -0,0 +1,379 @@
+/* --------------------------------------- fanout.c  -------------------------------------- */
+/* Provides fan-out pipelines, in which one producer feeds several branches. The producer   */
+/* is the stage before the first [|*], and every [|*] starts a branch (a chain of stages    */
+/* joined by [|]) reading its own copy of the producer's output. Branch outputs are merged  */
+/* on the shell's STDOUT unless redirected.                                                 */
+/*                                                                                          */
+/* A helper process duplicates the stream: tee(2) copies the head of the producer's pipe    */
+/* into each branch's pipe and splice(2) moves it into the last one, so data is never       */
+/* copied in user space unless a branch's pipe is too full to take a whole chunk. Every     */
+/* call blocks, so the slowest branch throttles the producer and memory use stays bounded.  */
+/* A branch which exits is dropped; the producer gets SIGPIPE once no branch is left.       */
+/*                                                                                          */
+/* zcat big.gz |* wc -l |* grep ERROR > errors |* gzip -1 > copy.gz                         */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define FANOUT_CHUNK 65536 // Max bytes duplicated per round, the default pipe capacity
+
+/* --------------------------------------- COPYING --------------------------------------- */
+// Drop branch i, whose reader has exited
+static void drop_branch(int *outputs, int *count, int i)
+{
+    close(outputs[i]);
+    outputs[i] = outputs[--(*count)];
+}
+
+// Write all length bytes of buffer to fd, returns 0, or -1 on error
+static int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+
+        if (written == -1)
+            return -1;
+
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Copy input to every output until the producer finishes or every branch has exited
+// The producer's first output is recorded when tracing
+static void fanout_run(int input, int *outputs, int count, int producer)
+{
+    bool started = false;
+
+    char *buffer = NULL; // Only allocated if a branch ever takes part of a chunk
+    ssize_t got[count];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while (count > 0)
+    {
+        // A single branch left: move the rest of the stream straight to it
+        if (count == 1)
+        {
+            ssize_t moved = splice(input, NULL, outputs[0], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+
+            if (moved == -1 && errno == EINTR)
+                continue;
+
+            if (moved <= 0)
+                break;
+
+            continue;
+        }
+
+        // The first branch sets the chunk size, the bytes waiting at the head of the input
+        ssize_t chunk = tee(input, outputs[0], FANOUT_CHUNK, 0);
+
+        if (chunk == -1 && errno == EINTR)
+            continue;
+
+        if (chunk == -1 && errno == EPIPE)
+        {
+            drop_branch(outputs, &count, 0);
+            continue;
+        }
+
+        if (chunk <= 0)
+            break;
+
+        if (!started)
+        {
+            trace_record(trace_clock(), TRACE_OUTPUT, 0, producer, 0, NULL);
+            started = true;
+        }
+
+        got[0] = chunk;
+        bool partial = false;
+
+        // Every other branch but the last gets a copy of the same chunk
+        for (int i = 1; i < count - 1; i++)
+        {
+            do
+            {
+                got[i] = tee(input, outputs[i], chunk, 0);
+            } while (got[i] == -1 && errno == EINTR);
+
+            // A branch which exited is treated as served, it is dropped once the chunk is done
+            if (got[i] == -1)
+                got[i] = errno == EPIPE ? -1 : 0;
+
+            partial |= got[i] >= 0 && got[i] < chunk;
+        }
+
+        int last = count - 1;
+        bool last_gone = false;
+
+        // Usual case: the chunk is moved into the last branch, consuming it from the input
+        if (!partial)
+        {
+            for (ssize_t moved = 0; moved < chunk;)
+            {
+                ssize_t n = splice(input, NULL, outputs[last], NULL, chunk - moved, SPLICE_F_MOVE);
+
+                if (n == -1 && errno == EINTR)
+                    continue;
+
+                // The last branch exited, the rest of the chunk is discarded
+                if (n == -1)
+                {
+                    last_gone = true;
+
+                    char discard[4096];
+
+                    while (moved < chunk)
+                    {
+                        ssize_t r = read(input, discard, chunk - moved < (ssize_t)sizeof(discard) ? chunk - moved : (ssize_t)sizeof(discard));
+
+                        if (r <= 0)
+                            break;
+
+                        moved += r;
+                    }
+
+                    break;
+                }
+
+                moved += n;
+            }
+        }
+
+        // A branch's pipe was too full for the whole chunk: the chunk is read once, and the
+        // missing part of each branch is written from user space
+        else
+        {
+            if (!buffer && !(buffer = malloc(FANOUT_CHUNK)))
+            {
+                perror("malloc() failed");
+                break;
+            }
+
+            for (ssize_t read_bytes = 0; read_bytes < chunk;)
+            {
+                ssize_t n = read(input, buffer + read_bytes, chunk - read_bytes);
+
+                if (n == -1 && errno == EINTR)
+                    continue;
+
+                if (n <= 0)
+                {
+                    chunk = read_bytes;
+                    break;
+                }
+
+                read_bytes += n;
+            }
+
+            for (int i = 1; i < last; i++)
+            {
+                if (got[i] >= 0 && got[i] < chunk && write_all(outputs[i], buffer + got[i], chunk - got[i]) == -1)
+                    got[i] = -1;
+            }
+
+            last_gone = write_all(outputs[last], buffer, chunk) == -1;
+        }
+
+        // Drop branches which exited, from the end so indices stay valid
+        if (last_gone)
+            drop_branch(outputs, &count, last);
+
+        for (int i = last - 1; i >= 1; i--)
+        {
+            if (got[i] == -1)
+                drop_branch(outputs, &count, i);
+        }
+    }
+
+    free(buffer);
+}
+
+/* --------------------------------------- STARTING -------------------------------------- */
+// Count the branches of a pipeline and find its producer, links[i] joins stage i to the
+// previous one (links may be NULL for a linear chain). Returns the number of branches
+static int count_branches(const pipe_link_t *links, int argc, int *producer)
+{
+    int branches = 0;
+
+    *producer = -1;
+
+    for (int i = 1; links && i < argc; i++)
+    {
+        if (links[i] != LINK_FANOUT)
+            continue;
+
+        if (*producer == -1)
+            *producer = i - 1;
+
+        branches++;
+    }
+
+    return branches;
+}
+
+// Create the pipes of a fan-out pipeline and fork the process copying between them
+// Returns 0 (fanout->producer is -1 for a linear chain), or -1 on error
+int fanout_start(job_t *job, fanout_t *fanout, const pipe_link_t *links, int argc)
+{
+    int branches = count_branches(links, argc, &fanout->producer);
+
+    fanout->output = -1;
+    fanout->branch_input = NULL;
+    fanout->stages = argc;
+
+    if (fanout->producer == -1)
+        return 0;
+
+    int input[2];
+    int outputs[branches];
+    int helper_ends[branches];
+
+    fanout->branch_input = malloc(argc * sizeof(*fanout->branch_input));
+
+    if (!fanout->branch_input)
+    {
+        perror("malloc() failed");
+        return -1;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        fanout->branch_input[i] = -1;
+    }
+
+    if (pipe2(input, O_CLOEXEC) == -1)
+    {
+        perror("pipe2() failed");
+        return -1;
+    }
+
+    fanout->output = input[1];
+
+    for (int i = 0, b = 0; i < argc; i++)
+    {
+        int branch[2];
+
+        if (links[i] != LINK_FANOUT || i == 0)
+            continue;
+
+        if (pipe2(branch, O_CLOEXEC) == -1)
+        {
+            perror("pipe2() failed");
+
+            close(input[0]);
+            for (int j = 0; j < b; j++)
+                close(helper_ends[j]);
+
+            return -1;
+        }
+
+        fanout->branch_input[i] = branch[0];
+        helper_ends[b] = outputs[b] = branch[1];
+        b++;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    uint64_t forked = trace_clock();
+    pid_t pid = fork();
+
+    if (pid == -1)
+    {
+        perror("fork() failed");
+
+        close(input[0]);
+        for (int j = 0; j < branches; j++)
+            close(helper_ends[j]);
+
+        return -1;
+    }
+
+    /* CHILD PROCESS */
+    if (pid == 0)
+    {
+        // Unblock the signals the event loop takes over, so Ctrl-C ends the helper with the stages
+        supervisor_child_reset();
+
+        // Only the producer and the branches may hold the stages' ends of the pipes
+        close(fanout->output);
+
+        for (int i = 0; i < argc; i++)
+        {
+            if (fanout->branch_input[i] != -1)
+                close(fanout->branch_input[i]);
+        }
+
+        fanout_run(input[0], outputs, branches, fanout->producer);
+        _exit(EXIT_SUCCESS);
+    }
+
+    /* PARENT PROCESS */
+    trace_record(forked, TRACE_FORK, pid, -1, 0, "fan-out");
+    close(input[0]);
+
+    for (int j = 0; j < branches; j++)
+    {
+        close(helper_ends[j]);
+    }
+
+    if (job_add(job, -1, pid) == -1)
+    {
+        perror("job_add() failed");
+    }
+
+    return 0;
+}
+
+/* --------------------------------------- CHILDREN -------------------------------------- */
+// Bind the producer's STDOUT or a branch's STDIN to the fan-out pipes, called in the child
+// Returns 0, or -1 on error
+int fanout_child(fanout_t *fanout, int stage)
+{
+    if (fanout->producer == -1)
+        return 0;
+
+    if (stage == fanout->producer && dup2(fanout->output, STDOUT_FILENO) == -1)
+        return -1;
+
+    if (fanout->branch_input[stage] != -1 && dup2(fanout->branch_input[stage], STDIN_FILENO) == -1)
+        return -1;
+
+    return 0;
+}
+
+// Close the shell's ends of the fan-out pipes once every stage has been forked
+void fanout_close(fanout_t *fanout)
+{
+    if (fanout->output != -1)
+        close(fanout->output);
+
+    for (int i = 0; fanout->branch_input && i < fanout->stages; i++)
+    {
+        if (fanout->branch_input[i] != -1)
+            close(fanout->branch_input[i]);
+    }
+
+    free(fanout->branch_input);
+
+    fanout->output = -1;
+    fanout->branch_input = NULL;
+}
@@ -0,0 +1,612 @@
+/* -------------------------------------- frecency.c -------------------------------------- */
+/* Provides the frecency directory database used by [z]. Every directory entered with [cd]  */
+/* or [z] is a visit, raising the directory's rank; directories are ranked by rank and how  */
+/* recently they were visited. The database ($XDG_DATA_HOME/tinyshell/z.db) is shared by    */
+/* every shell: it is mmap()ed and loaded into an in-memory index (an array of entries and  */
+/* a hash table of paths) only when another shell has replaced it. Visits are batched in    */
+/* memory and merged into the database under a lock every FRECENCY_BATCH visits and at      */
+/* exit, so a [cd] costs no I/O.                                                            */
+/*                                                                                          */
+/* z proj api          z -l log          z                                                  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define DATABASE_DIRECTORY "tinyshell"
+#define DATABASE_FILE "z.db"
+#define DATABASE_MAGIC "TSZ1"
+#define DATABASE_VERSION 1
+#define MAX_PATH 4096
+#define MIN_ENTRIES 64
+#define FRECENCY_BATCH 16     // Visits kept in memory before the database is written
+#define MAX_TOTAL_RANK 100000 // Ranks are aged once their total passes this
+#define AGING 0.99            // Factor applied to every rank when aging
+#define MIN_RANK 1.0          // Entries aged below this are forgotten
+
+#define HOUR 3600
+#define DAY (24 * HOUR)
+#define WEEK (7 * DAY)
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Database header, followed by count records
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t data_length;
+} database_header_t;
+
+// Database record, followed by length bytes of path and a NUL
+typedef struct
+{
+    double rank;
+    int64_t last; // Time of the last visit
+    uint32_t length;
+} database_record_t;
+
+// Single directory in the in-memory index
+typedef struct
+{
+    char *path;
+    double rank;
+    int64_t last;
+} entry_t;
+
+// Entry of the index and its score, for ranking
+typedef struct
+{
+    double score;
+    int entry;
+} ranked_t;
+
+// Visit not yet written to the database
+typedef struct
+{
+    char *path;
+    int64_t time;
+} visit_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static entry_t *entries = NULL;
+static int entry_count = 0,
+           entry_capacity = 0;
+static double total_rank = 0;
+
+static int *slots = NULL; // Hash table of entry index + 1, 0 for an empty slot
+static int slot_count = 0;
+
+static visit_t pending[FRECENCY_BATCH];
+static int pending_count = 0;
+
+static bool loaded = false; // Whether the index holds the database identified by loaded_stat
+static struct stat loaded_stat;
+static pid_t owner = 0; // Shell which records visits, subshells do not write them again
+
+/* ---------------------------------------- INDEX ---------------------------------------- */
+static void index_clear(void)
+{
+    for (int i = 0; i < entry_count; i++)
+    {
+        free(entries[i].path);
+    }
+
+    entry_count = 0;
+    total_rank = 0;
+
+    if (slots)
+        memset(slots, 0, slot_count * sizeof(*slots));
+}
+
+// Slot of path in the hash table, either holding it or the empty slot it would go in
+static int *index_slot(const char *path)
+{
+    uint64_t hash = fnv1a(path, strlen(path));
+
+    for (int s = hash & (slot_count - 1);; s = (s + 1) & (slot_count - 1))
+    {
+        if (slots[s] == 0 || strcmp(entries[slots[s] - 1].path, path) == 0)
+            return &slots[s];
+    }
+}
+
+// Rebuild the hash table with room for twice the entries
+static int index_rehash(void)
+{
+    int count = slot_count ? slot_count * 2 : MIN_ENTRIES * 2;
+    int *grown = calloc(count, sizeof(*grown));
+
+    if (!grown)
+    {
+        perror("calloc() failed");
+        return -1;
+    }
+
+    free(slots);
+    slots = grown;
+    slot_count = count;
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        *index_slot(entries[i].path) = i + 1;
+    }
+
+    return 0;
+}
+
+// Entry of path, added with no rank if it is not in the index. Returns NULL on error
+static entry_t *index_add(const char *path)
+{
+    // Table kept at most half full
+    if (2 * (entry_count + 1) > slot_count && index_rehash() == -1)
+        return NULL;
+
+    int *slot = index_slot(path);
+
+    if (*slot)
+        return &entries[*slot - 1];
+
+    if (entry_count == entry_capacity)
+    {
+        int capacity = entry_capacity ? entry_capacity * 2 : MIN_ENTRIES;
+        entry_t *grown = realloc(entries, capacity * sizeof(*entries));
+
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return NULL;
+        }
+
+        entries = grown;
+        entry_capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+
+    if (!copy)
+    {
+        perror("strdup() failed");
+        return NULL;
+    }
+
+    entries[entry_count] = (entry_t){copy, 0, 0};
+    *slot = ++entry_count;
+
+    return &entries[entry_count - 1];
+}
+
+// Scale every rank down, forgetting the entries which drop below MIN_RANK
+static void index_age(void)
+{
+    int kept = 0;
+
+    total_rank = 0;
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        entries[i].rank *= AGING;
+
+        if (entries[i].rank < MIN_RANK)
+        {
+            free(entries[i].path);
+            continue;
+        }
+
+        total_rank += entries[i].rank;
+        entries[kept++] = entries[i];
+    }
+
+    entry_count = kept;
+    memset(slots, 0, slot_count * sizeof(*slots));
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        *index_slot(entries[i].path) = i + 1;
+    }
+}
+
+static void index_visit(const char *path, int64_t time)
+{
+    entry_t *entry = index_add(path);
+
+    if (!entry)
+        return;
+
+    entry->rank += 1;
+    entry->last = time;
+    total_rank += 1;
+
+    if (total_rank > MAX_TOTAL_RANK)
+        index_age();
+}
+
+/* -------------------------------------- DATABASE --------------------------------------- */
+// Path of the database, its directory is created when create is set
+static int database_path(char *path, size_t size, bool create)
+{
+    const char *data = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    char directory[MAX_PATH];
+
+    if (data && *data)
+        snprintf(directory, sizeof(directory), "%s", data);
+    else if (home)
+        snprintf(directory, sizeof(directory), "%s/.local/share", home);
+    else
+        return -1;
+
+    // Parents are created one at a time, [~/.local/share] may not exist yet
+    for (char *slash = create ? strchr(directory + 1, '/') : NULL; slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(directory, 0700);
+        *slash = '/';
+    }
+
+    if (create)
+        mkdir(directory, 0700);
+
+    size_t length = strlen(directory);
+    snprintf(directory + length, sizeof(directory) - length, "/%s", DATABASE_DIRECTORY);
+
+    if (create && mkdir(directory, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    return snprintf(path, size, "%s/%s", directory, DATABASE_FILE) < (int)size ? 0 : -1;
+}
+
+// Load the database into the index, unless it is already loaded and unchanged
+// Visits not yet written are applied on top. Returns 0, or -1 on error
+static int database_load(void)
+{
+    char path[MAX_PATH];
+    struct stat st;
+
+    if (database_path(path, sizeof(path), false) == -1)
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        // No database yet, the index only holds this shell's visits
+        if (fd != -1)
+            close(fd);
+
+        if (loaded && loaded_stat.st_ino == 0)
+            return 0;
+
+        index_clear();
+
+        for (int i = 0; i < pending_count; i++)
+        {
+            index_visit(pending[i].path, pending[i].time);
+        }
+
+        memset(&loaded_stat, 0, sizeof(loaded_stat));
+        loaded = true;
+        return 0;
+    }
+
+    // The database is only ever replaced by rename(), never rewritten in place
+    if (loaded && st.st_ino == loaded_stat.st_ino && st.st_dev == loaded_stat.st_dev &&
+        st.st_mtim.tv_sec == loaded_stat.st_mtim.tv_sec && st.st_mtim.tv_nsec == loaded_stat.st_mtim.tv_nsec)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    index_clear();
+    loaded_stat = st;
+    loaded = true;
+
+    if (data != MAP_FAILED)
+    {
+        const database_header_t *header = (const database_header_t *)data;
+        const char *cursor = data + sizeof(*header),
+                   *end = data + st.st_size;
+
+        bool valid = (size_t)st.st_size >= sizeof(*header) &&
+                     memcmp(header->magic, DATABASE_MAGIC, 4) == 0 &&
+                     header->version == DATABASE_VERSION &&
+                     header->data_length == st.st_size - sizeof(*header);
+
+        for (uint32_t i = 0; valid && i < header->count; i++)
+        {
+            database_record_t record;
+
+            if ((size_t)(end - cursor) < sizeof(record))
+                break;
+
+            memcpy(&record, cursor, sizeof(record));
+            cursor += sizeof(record);
+
+            if ((size_t)(end - cursor) <= record.length || cursor[record.length] != '\0')
+                break;
+
+            entry_t *entry = index_add(cursor);
+
+            if (!entry)
+                break;
+
+            entry->rank = record.rank;
+            entry->last = record.last;
+            total_rank += record.rank;
+            cursor += record.length + 1;
+        }
+
+        munmap(data, st.st_size);
+    }
+
+    for (int i = 0; i < pending_count; i++)
+    {
+        index_visit(pending[i].path, pending[i].time);
+    }
+
+    return 0;
+}
+
+// Write the index to a temporary file and rename it over the database
+static int database_save(const char *path)
+{
+    char temporary[MAX_PATH + 32];
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid());
+
+    FILE *file = fopen(temporary, "we");
+
+    if (!file)
+        return -1;
+
+    database_header_t header = {.magic = DATABASE_MAGIC, .version = DATABASE_VERSION, .count = entry_count};
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        header.data_length += sizeof(database_record_t) + strlen(entries[i].path) + 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        database_record_t record = {entries[i].rank, entries[i].last, strlen(entries[i].path)};
+
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(entries[i].path, record.length + 1, 1, file);
+    }
+
+    struct stat st;
+
+    if (fflush(file) != 0 || fstat(fileno(file), &st) == -1 || fclose(file) != 0 || rename(temporary, path) == -1)
+    {
+        unlink(temporary);
+        return -1;
+    }
+
+    // The index now matches the database, another load is not needed
+    loaded_stat = st;
+    return 0;
+}
+
+// Merge the visits not yet written into the database, under a lock so concurrent shells do
+// not lose each other's visits
+void frecency_flush(void)
+{
+    char path[MAX_PATH], lock_path[MAX_PATH + 8];
+
+    if (pending_count == 0 || getpid() != owner)
+        return;
+
+    if (database_path(path, sizeof(path), true) == -1)
+        return;
+
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (lock == -1 || flock(lock, LOCK_EX) == -1)
+    {
+        if (lock != -1)
+            close(lock);
+
+        return;
+    }
+
+    // Reload whatever other shells wrote since, then apply this shell's visits
+    loaded = false;
+
+    if (database_load() == 0 && database_save(path) == 0)
+    {
+        for (int i = 0; i < pending_count; i++)
+            free(pending[i].path);
+
+        pending_count = 0;
+    }
+
+    close(lock);
+}
+
+static void frecency_exit(void)
+{
+    frecency_flush();
+}
+
+/* --------------------------------------- VISITS ---------------------------------------- */
+// Record a visit to the directory path
+void frecency_visit(const char *path)
+{
+    static bool registered = false;
+
+    if (!registered)
+    {
+        registered = atexit(frecency_exit) == 0;
+        owner = getpid();
+    }
+
+    // A subshell's visits are its own, the inherited batch belongs to the parent
+    if (getpid() != owner)
+        return;
+
+    char *copy = strdup(path);
+
+    if (!copy)
+    {
+        perror("strdup() failed");
+        return;
+    }
+
+    // The batch is still full when the database could not be written, the oldest visit is
+    // dropped to make room
+    if (pending_count == FRECENCY_BATCH)
+    {
+        free(pending[0].path);
+        memmove(pending, pending + 1, (FRECENCY_BATCH - 1) * sizeof(*pending));
+        pending_count--;
+    }
+
+    pending[pending_count++] = (visit_t){copy, time(NULL)};
+
+    // The loaded index is kept current, an index not loaded yet gets the visit on load
+    if (loaded)
+        index_visit(path, pending[pending_count - 1].time);
+
+    if (pending_count == FRECENCY_BATCH)
+        frecency_flush();
+}
+
+/* --------------------------------------- LOOKUP ---------------------------------------- */
+// Rank weighted by how recently the entry was visited
+static double frecency(const entry_t *entry, int64_t now)
+{
+    int64_t age = now - entry->last;
+
+    if (age < HOUR)
+        return entry->rank * 4;
+
+    if (age < DAY)
+        return entry->rank * 2;
+
+    if (age < WEEK)
+        return entry->rank / 2;
+
+    return entry->rank / 4;
+}
+
+// Whether path contains every pattern, in order
+static bool matches(const char *path, char **patterns, bool ignore_case)
+{
+    for (int i = 0; patterns[i]; i++)
+    {
+        const char *found = ignore_case ? strcasestr(path, patterns[i]) : strstr(path, patterns[i]);
+
+        if (!found)
+            return false;
+
+        path = found + strlen(patterns[i]);
+    }
+
+    return true;
+}
+
+// Ascending scores; among equal scores the earlier entry sorts last, as the better one
+static int compare_scores(const void *a, const void *b)
+{
+    const ranked_t *x = a, *y = b;
+
+    if (x->score != y->score)
+        return (x->score > y->score) - (x->score < y->score);
+
+    return y->entry - x->entry;
+}
+
+// Best ranked existing directory matching patterns, or NULL if there is none
+// Patterns are matched case-sensitively first, then ignoring case
+const char *frecency_best(char **patterns)
+{
+    if (database_load() == -1 || entry_count == 0)
+        return NULL;
+
+    int64_t now = time(NULL);
+    ranked_t *ranked = malloc(entry_count * sizeof(*ranked));
+    const char *best = NULL;
+
+    if (!ranked)
+    {
+        perror("malloc() failed");
+        return NULL;
+    }
+
+    for (int ignore_case = 0; ignore_case < 2 && !best; ignore_case++)
+    {
+        int count = 0;
+
+        for (int i = 0; i < entry_count; i++)
+        {
+            if (matches(entries[i].path, patterns, ignore_case))
+                ranked[count++] = (ranked_t){frecency(&entries[i], now), i};
+        }
+
+        qsort(ranked, count, sizeof(*ranked), compare_scores);
+
+        // Directories removed since their last visit are passed over
+        for (int i = count - 1; i >= 0 && !best; i--)
+        {
+            struct stat st;
+            const char *path = entries[ranked[i].entry].path;
+
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+                best = path;
+        }
+    }
+
+    free(ranked);
+    return best;
+}
+
+// Print the entries matching patterns, lowest score first so the best ends up by the prompt
+void frecency_list(char **patterns)
+{
+    if (database_load() == -1 || entry_count == 0)
+        return;
+
+    int64_t now = time(NULL);
+    ranked_t *ranked = malloc(entry_count * sizeof(*ranked));
+    int count = 0;
+
+    if (!ranked)
+    {
+        perror("malloc() failed");
+        return;
+    }
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        if (matches(entries[i].path, patterns, false))
+        {
+            ranked[count++] = (ranked_t){frecency(&entries[i], now), i};
+        }
+    }
+
+    qsort(ranked, count, sizeof(*ranked), compare_scores);
+
+    for (int i = 0; i < count; i++)
+    {
+        printf("%-10.1f %s\n", ranked[i].score, entries[ranked[i].entry].path);
+    }
+
+    free(ranked);
+}
@@ -0,0 +1,770 @@
+/* ------------------------------------- inprocess.c  ------------------------------------- */
+/* Runs pipeline stages on threads inside the shell instead of forking them. Builtins which */
+/* only read shell state ([cwd], [ver]) and a few filters ([echo], [cat], [head], [wc]) are */
+/* run this way, unless their arguments need the external command. Adjacent in-process      */
+/* stages are joined by a single-producer single-consumer byte ring rather than a pipe; a   */
+/* stage next to an external command reads or writes the pipe end directly. A finished      */
+/* thread writes its job to a pipe watched by the event loop, so it counts towards          */
+/* job->running like a child. Stages with redirections, substitutions or prefixes always    */
+/* fork, as do background and fan-out pipelines. [set +o inprocess] forks every stage.      */
+/* inprocess_start() also runs the helpers of compressed redirections (redirection.c).      */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define RING_SIZE (64 * 1024) // Bytes buffered between two in-process stages, a power of 2
+#define SPIN_LIMIT 256        // Polls of the other side before sleeping on the futex
+#define CHUNK 16384           // Bytes copied per read by the filters
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Written by one stage, read by the next. head and tail count every byte ever written and
+// read, so head - tail is the number buffered. Either side sleeps on the futex word wake
+// once the other has made no progress for SPIN_LIMIT polls
+struct ring_t
+{
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint32_t wake;    // Bumped by a side which made progress while the other sleeps
+    _Atomic uint32_t waiting; // Sides sleeping on wake
+    _Atomic bool writer_closed;
+    _Atomic bool reader_closed;
+    _Atomic int references; // Sides still open
+    char data[RING_SIZE];
+};
+
+// Stage started on a thread
+typedef struct
+{
+    inprocess_fn_t run;
+    char **args;
+    stream_t in;
+    stream_t out;
+    job_t *job;
+    int *status; // job->status[stage], NULL for a helper
+} stage_t;
+
+typedef struct
+{
+    const char *name;
+    inprocess_fn_t run;
+    bool (*accepts)(char **args); // Whether the filter supports every argument
+} filter_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static int done_pipe[2] = {-1, -1}; // Each finished thread writes its job_t * to it
+static pid_t done_owner = 0;         // Process which created done_pipe
+
+/* ---------------------------------------- RINGS ---------------------------------------- */
+static void futex(_Atomic uint32_t *word, int op, uint32_t value)
+{
+    syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+ring_t *ring_create(void)
+{
+    ring_t *ring = malloc(sizeof(*ring));
+
+    if (!ring)
+        return NULL;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->wake, 0);
+    atomic_init(&ring->waiting, 0);
+    atomic_init(&ring->writer_closed, false);
+    atomic_init(&ring->reader_closed, false);
+    atomic_init(&ring->references, 2);
+
+    return ring;
+}
+
+// Wake the other side if it sleeps, after head, tail or a closed flag changed
+static void ring_notify(ring_t *ring)
+{
+    if (atomic_load(&ring->waiting) > 0)
+    {
+        atomic_fetch_add(&ring->wake, 1);
+        futex(&ring->wake, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+}
+
+static bool can_write(ring_t *ring)
+{
+    return atomic_load(&ring->reader_closed) || atomic_load(&ring->head) - atomic_load(&ring->tail) < RING_SIZE;
+}
+
+static bool can_read(ring_t *ring)
+{
+    return atomic_load(&ring->writer_closed) || atomic_load(&ring->head) != atomic_load(&ring->tail);
+}
+
+// Block until ready(ring). The other side bumps wake after waiting is seen, so a change
+// made between the check and the futex call makes FUTEX_WAIT return at once
+static void ring_wait(ring_t *ring, bool (*ready)(ring_t *))
+{
+    for (int i = 0; i < SPIN_LIMIT; i++)
+    {
+        if (ready(ring))
+            return;
+    }
+
+    while (!ready(ring))
+    {
+        uint32_t wake = atomic_load(&ring->wake);
+
+        atomic_fetch_add(&ring->waiting, 1);
+
+        if (!ready(ring))
+            futex(&ring->wake, FUTEX_WAIT_PRIVATE, wake);
+
+        atomic_fetch_sub(&ring->waiting, 1);
+    }
+}
+
+// Returns 0, or -1 with errno EPIPE if the reader has gone
+static int ring_write(ring_t *ring, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ring_wait(ring, can_write);
+
+        if (atomic_load(&ring->reader_closed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed),
+                 space = RING_SIZE - (head - atomic_load(&ring->tail));
+        size_t offset = head & (RING_SIZE - 1),
+               n = length < space ? length : space,
+               first = n < RING_SIZE - offset ? n : RING_SIZE - offset;
+
+        memcpy(ring->data + offset, buffer, first);
+        memcpy(ring->data, buffer + first, n - first);
+
+        atomic_store(&ring->head, head + n);
+        ring_notify(ring);
+
+        buffer += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Returns the number of bytes read, 0 once the writer has closed and the ring is empty
+static ssize_t ring_read(ring_t *ring, char *buffer, size_t length)
+{
+    ring_wait(ring, can_read);
+
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed),
+             available = atomic_load(&ring->head) - tail;
+    size_t offset = tail & (RING_SIZE - 1),
+           n = length < available ? length : available,
+           first = n < RING_SIZE - offset ? n : RING_SIZE - offset;
+
+    memcpy(buffer, ring->data + offset, first);
+    memcpy(buffer + first, ring->data, n - first);
+
+    atomic_store(&ring->tail, tail + n);
+    ring_notify(ring);
+
+    return n;
+}
+
+// Close one side of the ring, the last side to close frees it
+void ring_close(ring_t *ring, bool writer)
+{
+    atomic_store(writer ? &ring->writer_closed : &ring->reader_closed, true);
+    ring_notify(ring);
+
+    if (atomic_fetch_sub(&ring->references, 1) == 1)
+        free(ring);
+}
+
+/* --------------------------------------- STREAMS --------------------------------------- */
+ssize_t stream_read(stream_t *stream, char *buffer, size_t length)
+{
+    if (stream->ring)
+        return ring_read(stream->ring, buffer, length);
+
+    ssize_t n;
+
+    while ((n = read(stream->fd, buffer, length)) == -1 && errno == EINTR)
+        ;
+
+    return n;
+}
+
+int stream_write(stream_t *stream, const char *buffer, size_t length)
+{
+    if (stream->ring)
+    {
+        if (ring_write(stream->ring, buffer, length) == -1)
+        {
+            stream->broken = true;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    while (length > 0)
+    {
+        ssize_t written = write(stream->fd, buffer, length);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+
+        if (written == -1)
+        {
+            stream->broken = errno == EPIPE;
+            return -1;
+        }
+
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Close the stage's end. A reader closing early makes the writer fail with EPIPE, an
+// external writer is killed by SIGPIPE as it would be by an exiting reader process
+void stream_close(stream_t *stream, bool writer)
+{
+    if (stream->ring)
+        ring_close(stream->ring, writer);
+    else if (stream->fd != -1)
+        close(stream->fd);
+
+    stream->ring = NULL;
+    stream->fd = -1;
+}
+
+/* --------------------------------------- FILTERS --------------------------------------- */
+// Copy in to out until EOF. Returns 0, or -1 if either failed
+static int copy_stream(stream_t *in, stream_t *out)
+{
+    char buffer[CHUNK];
+    ssize_t n;
+
+    while ((n = stream_read(in, buffer, sizeof(buffer))) > 0)
+    {
+        if (stream_write(out, buffer, n) == -1)
+            return -1;
+    }
+
+    return n == 0 ? 0 : -1;
+}
+
+// Whether arg is an option to coreutils' echo, i.e. made of [-n], [-e] and [-E]
+static bool echo_option(const char *arg)
+{
+    return arg[0] == '-' && arg[1] != '\0' && strspn(arg + 1, "neE") == strlen(arg + 1);
+}
+
+// [echo [-n] args...], other options (-e, -E) run the external command
+static bool echo_accepts(char **args)
+{
+    for (char **arg = args + 1; *arg && echo_option(*arg); arg++)
+    {
+        if (strcmp(*arg, "-n") != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static int echo_filter(char **args, stream_t *in, stream_t *out)
+{
+    char **arg = args + 1;
+
+    while (*arg && echo_option(*arg))
+        arg++;
+
+    for (char **first = arg; *arg; arg++)
+    {
+        if ((arg != first && stream_write(out, " ", 1) == -1) || stream_write(out, *arg, strlen(*arg)) == -1)
+            return EXIT_FAILURE;
+    }
+
+    if (!(args[1] && echo_option(args[1])) && stream_write(out, "\n", 1) == -1)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+// [cat [FILE...]], [-] for STDIN, any option runs the external command
+static bool cat_accepts(char **args)
+{
+    for (char **arg = args + 1; *arg; arg++)
+    {
+        if ((*arg)[0] == '-' && (*arg)[1] != '\0')
+            return false;
+    }
+
+    return true;
+}
+
+static int cat_filter(char **args, stream_t *in, stream_t *out)
+{
+    int status = EXIT_SUCCESS;
+
+    if (!args[1])
+        return copy_stream(in, out) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (char **arg = args + 1; *arg; arg++)
+    {
+        if (strcmp(*arg, "-") == 0)
+        {
+            if (copy_stream(in, out) == -1)
+                return EXIT_FAILURE;
+
+            continue;
+        }
+
+        stream_t file = {open(*arg, O_RDONLY | O_CLOEXEC), NULL, false};
+
+        if (file.fd == -1)
+        {
+            fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        int copied = copy_stream(&file, out);
+
+        stream_close(&file, false);
+
+        if (copied == -1)
+            return EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+// Line count of [head -n N], [head -nN] or [head -N], or 10. Returns -1 if invalid
+static long head_lines(char **args, char **file)
+{
+    char **arg = args + 1;
+    const char *value = "10";
+
+    if (*arg && strcmp(*arg, "-n") == 0 && arg[1])
+    {
+        value = arg[1];
+        arg += 2;
+    }
+
+    else if (*arg && strncmp(*arg, "-n", 2) == 0)
+    {
+        value = *arg++ + 2;
+    }
+
+    else if (*arg && (*arg)[0] == '-' && isdigit((unsigned char)(*arg)[1]))
+    {
+        value = *arg++ + 1;
+    }
+
+    char *end;
+    long lines = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || lines < 0 || (*arg && arg[1]) || (*arg && (*arg)[0] == '-'))
+        return -1;
+
+    *file = *arg;
+    return lines;
+}
+
+// [head [-n N] [FILE]], other options or several files run the external command
+static bool head_accepts(char **args)
+{
+    char *file;
+
+    return head_lines(args, &file) != -1;
+}
+
+static int head_filter(char **args, stream_t *in, stream_t *out)
+{
+    char *path;
+    long lines = head_lines(args, &path);
+    stream_t file = {-1, NULL, false};
+
+    if (path && (file.fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "head: cannot open '%s' for reading: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    stream_t *source = path ? &file : in;
+    char buffer[CHUNK];
+    ssize_t n = 0;
+
+    while (lines > 0 && (n = stream_read(source, buffer, sizeof(buffer))) > 0)
+    {
+        char *end = buffer;
+
+        while (lines > 0 && (end = memchr(end, '\n', buffer + n - end)))
+        {
+            end++;
+            lines--;
+        }
+
+        size_t length = lines == 0 ? (size_t)(end - buffer) : (size_t)n;
+
+        if (stream_write(out, buffer, length) == -1)
+        {
+            n = -1;
+            break;
+        }
+    }
+
+    stream_close(&file, false);
+
+    return n == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// [wc [-l] [-w] [-c]] on STDIN, file arguments and other options run the external command
+static bool wc_accepts(char **args)
+{
+    for (char **arg = args + 1; *arg; arg++)
+    {
+        if ((*arg)[0] != '-' || (*arg)[1] == '\0' || strspn(*arg + 1, "lwc") != strlen(*arg + 1))
+            return false;
+    }
+
+    return true;
+}
+
+static int wc_filter(char **args, stream_t *in, stream_t *out)
+{
+    bool show[3] = {false, false, false}; // Lines, words, bytes
+    long long counts[3] = {0, 0, 0};
+    int shown = 0;
+
+    for (char **arg = args + 1; *arg; arg++)
+    {
+        show[0] |= strchr(*arg, 'l') != NULL;
+        show[1] |= strchr(*arg, 'w') != NULL;
+        show[2] |= strchr(*arg, 'c') != NULL;
+    }
+
+    if (!show[0] && !show[1] && !show[2])
+        show[0] = show[1] = show[2] = true;
+
+    char buffer[CHUNK];
+    ssize_t n;
+    bool in_word = false;
+
+    while ((n = stream_read(in, buffer, sizeof(buffer))) > 0)
+    {
+        counts[2] += n;
+
+        // Lines alone are counted with memchr(), as fast as coreutils' wc -l
+        if (!show[1])
+        {
+            for (char *line = buffer; (line = memchr(line, '\n', buffer + n - line)); line++)
+                counts[0]++;
+
+            continue;
+        }
+
+        for (ssize_t i = 0; i < n; i++)
+        {
+            bool space = isspace((unsigned char)buffer[i]);
+
+            counts[0] += buffer[i] == '\n';
+            counts[1] += !space && !in_word;
+            in_word = !space;
+        }
+    }
+
+    if (n == -1)
+    {
+        perror("wc: read() failed");
+        return EXIT_FAILURE;
+    }
+
+    // Like coreutils reading STDIN: a single count is unpadded, several are 7 wide
+    char text[80];
+    int length = 0;
+
+    for (int i = 0; i < 3; i++)
+        shown += show[i];
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (show[i])
+            length += snprintf(text + length, sizeof(text) - length, "%s%*lld", length ? " " : "", shown > 1 ? 7 : 0, counts[i]);
+    }
+
+    text[length++] = '\n';
+
+    return stream_write(out, text, length) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static const filter_t filter_list[] =
+    {
+        {"echo", &echo_filter, &echo_accepts},
+        {"cat", &cat_filter, &cat_accepts},
+        {"head", &head_filter, &head_accepts},
+        {"wc", &wc_filter, &wc_accepts},
+};
+
+/* --------------------------------------- BUILTINS -------------------------------------- */
+static ssize_t output_write(void *cookie, const char *buffer, size_t length)
+{
+    return stream_write(cookie, buffer, length) == -1 ? 0 : (ssize_t)length;
+}
+
+// Builtin stage: its STDOUT is a FILE writing to the stage's output stream
+static int builtin_stage(char **args, stream_t *in, stream_t *out)
+{
+    builtin_output = fopencookie(out, "w", (cookie_io_functions_t){.write = output_write});
+
+    if (!builtin_output)
+    {
+        perror("fopencookie() failed");
+        return EXIT_FAILURE;
+    }
+
+    int status = execute_builtin(args[0], args, false);
+
+    fclose(builtin_output);
+    builtin_output = NULL;
+
+    return status;
+}
+
+/* --------------------------------------- PLANNING -------------------------------------- */
+// Whether any prefix attribute applies to stage, these need a process of its own
+static bool has_prefix(pipeline_attr_t *attr, int stage)
+{
+    if (!attr)
+        return false;
+
+    const sched_attr_t *sched[2] = {&attr->sched, attr->stage_sched ? &attr->stage_sched[stage] : NULL};
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (sched[i] && (sched[i]->set_cpus || sched[i]->set_nice || sched[i]->set_ioprio || sched[i]->set_policy))
+            return true;
+    }
+
+    return attr->rlimit_count > 0 || attr->memory_max >= 0 || attr->cpu_quota >= 0 || attr->pids_max >= 0 ||
+           attr->spread || attr->timeout > 0;
+}
+
+// Function running args on a thread, or NULL if it is an external command
+static inprocess_fn_t lookup(char **args)
+{
+    if (builtin_threaded(args[0]))
+        return &builtin_stage;
+
+    for (size_t i = 0; i < sizeof(filter_list) / sizeof(*filter_list); i++)
+    {
+        if (strcmp(filter_list[i].name, args[0]) == 0)
+            return filter_list[i].accepts(args) ? filter_list[i].run : NULL;
+    }
+
+    return NULL;
+}
+
+// Whether the in-process stage args reads its STDIN
+static bool reads_input(char **args)
+{
+    char *file = NULL;
+
+    if (strcmp(args[0], "wc") == 0)
+        return true;
+
+    if (strcmp(args[0], "head") == 0)
+        return head_lines(args, &file) != -1 && !file;
+
+    if (strcmp(args[0], "cat") == 0)
+    {
+        for (char **arg = args + 1; *arg; arg++)
+        {
+            if (strcmp(*arg, "-") == 0)
+                return true;
+        }
+
+        return !args[1];
+    }
+
+    return false;
+}
+
+// Set stages[i] to the function running stage i on a thread, or NULL if it is forked
+void inprocess_plan(inprocess_fn_t *stages, int argc, char **pipeline[], const pipe_link_t *links, bool async,
+                    redirect_t *redirects, int redirect_count, substitution_t *substitutions, int substitution_count,
+                    pipeline_attr_t *attr)
+{
+    bool linear = true;
+
+    for (int i = 1; links && i < argc; i++)
+    {
+        linear &= links[i] == LINK_PIPE;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        stages[i] = NULL;
+
+        // A single command is a builtin run by the shell itself, or an external command
+        if (!option_inprocess || async || !linear || argc == 1 || has_prefix(attr, i))
+            continue;
+
+        bool own_fds = false;
+
+        for (int r = 0; r < redirect_count; r++)
+            own_fds |= redirects[r].stage == i;
+
+        for (int s = 0; s < substitution_count; s++)
+            own_fds |= substitutions[s].stage == i;
+
+        if (own_fds)
+            continue;
+
+        stages[i] = lookup(pipeline[i]);
+
+        // A thread cannot be interrupted, so reading the terminal is left to a process
+        if (i == 0 && stages[i] && reads_input(pipeline[i]) && isatty(STDIN_FILENO))
+            stages[i] = NULL;
+    }
+}
+
+/* --------------------------------------- THREADS --------------------------------------- */
+// Called by the event loop when threads have finished, each wrote its job to the pipe
+static void thread_done(int fd)
+{
+    job_t *finished[64];
+    ssize_t n = read(fd, finished, sizeof(finished));
+
+    for (ssize_t i = 0; i < n / (ssize_t)sizeof(*finished); i++)
+    {
+        finished[i]->running--;
+    }
+}
+
+static void *stage_thread(void *context)
+{
+    stage_t *stage = context;
+    job_t *job = stage->job;
+    int status = stage->run(stage->args, &stage->in, &stage->out);
+
+    // Whichever filter or builtin ran, a stage whose reader has gone ends as a forked one
+    // killed by SIGPIPE would
+    if (stage->out.broken)
+        status = 128 + SIGPIPE;
+
+    stream_close(&stage->in, false);
+    stream_close(&stage->out, true);
+
+    if (stage->status)
+        *stage->status = status;
+
+    free(stage);
+
+    // The last access to the job, the shell may free it once running reaches 0. A pointer
+    // is written in a single write() since it is smaller than PIPE_BUF
+    write(done_pipe[1], &job, sizeof(job));
+
+    return NULL;
+}
+
+// Create the pipe finished threads write to, once per process: a forked subshell has its
+// own event loop and does not inherit the shell's descriptors
+static int done_pipe_open(void)
+{
+    if (done_owner == getpid())
+        return 0;
+
+    if (pipe2(done_pipe, O_CLOEXEC) == -1)
+        return -1;
+
+    fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+
+    if (supervisor_watch(done_pipe[0], thread_done) == -1)
+    {
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        return -1;
+    }
+
+    done_owner = getpid();
+    return 0;
+}
+
+// Start stage of job on a thread, reading in and writing out, or a helper of the job if
+// stage is -1. The thread owns both streams, they are closed here if it cannot be started
+// Returns 0, or -1 on error
+int inprocess_start(job_t *job, int stage, inprocess_fn_t run, char **args, stream_t in, stream_t out)
+{
+    stage_t *context = malloc(sizeof(*context));
+
+    if (!context || done_pipe_open() == -1)
+    {
+        perror("inprocess_start() failed");
+        free(context);
+        stream_close(&in, false);
+        stream_close(&out, true);
+        return -1;
+    }
+
+    *context = (stage_t){run, args, in, out, job, stage >= 0 ? &job->status[stage] : NULL};
+
+    // Writing to a closed pipe fails with EPIPE instead of killing the shell, the signal is
+    // thread-directed and left pending until the thread exits
+    sigset_t block, previous;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &previous);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int error = pthread_create(&thread, &attr, stage_thread, context);
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0)
+    {
+        errno = error;
+        perror("pthread_create() failed");
+        stream_close(&context->in, false);
+        stream_close(&context->out, true);
+        free(context);
+        return -1;
+    }
+
+    job->running++;
+
+    if (stage >= 0)
+    {
+        job->pids[stage] = 0;
+        job->count = stage + 1 > job->count ? stage + 1 : job->count;
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/* --------------------------------------- input.c  --------------------------------------- */
+/* Provides the read_line() function, a streaming reader which returns one logical command  */
+/* line at a time. Input is read with read() in large chunks and copied into a growable     */
+/* line buffer in a single pass, so lines of any length are read in linear time and memory. */
+/* A backslash-newline pair is removed and the line continues on the next physical line,    */
+/* as does a line ending inside a double quoted string (the newline is then kept).          */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define READ_CHUNK 65536 // Bytes requested from read() at a time
+#define MIN_LINE 256     // Initial line buffer capacity
+#define CONTINUATION_PROMPT "> "
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static char chunk[READ_CHUNK];
+static size_t chunk_start = 0, // First unconsumed byte of chunk
+    chunk_end = 0;             // End of valid data in chunk
+
+static char *line = NULL;
+static size_t line_length = 0,
+              line_capacity = 0;
+
+/* -------------------------------------- UTILITIES -------------------------------------- */
+static int line_put(char c)
+{
+    if (line_length + 1 >= line_capacity)
+    {
+        size_t capacity = line_capacity ? line_capacity * 2 : MIN_LINE;
+        char *grown = realloc(line, capacity);
+
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
+
+        line = grown;
+        line_capacity = capacity;
+    }
+
+    line[line_length++] = c;
+    return 0;
+}
+
+// Refill chunk from fd, returns bytes read, 0 at end of input, -1 on error or ^C at the prompt
+static ssize_t fill(int fd, bool continuation)
+{
+    if (continuation && isatty(fd))
+    {
+        printf(CONTINUATION_PROMPT);
+    }
+
+    // Background jobs are still reaped while waiting for input, [^C] abandons the prompt
+    if (supervisor_wait_input(fd) == 1)
+    {
+        printf("\n");
+        errno = EINTR;
+        return -1;
+    }
+
+    ssize_t bytes;
+
+    do
+    {
+        bytes = read(fd, chunk, READ_CHUNK);
+    } while (bytes == -1 && errno == EINTR);
+
+    chunk_start = 0;
+    chunk_end = bytes > 0 ? bytes : 0;
+
+    return bytes;
+}
+
+/* --------------------------------------- READING --------------------------------------- */
+// Read the next logical line from fd into *out (NUL terminated, valid until the next call)
+// Returns 0 on success, 1 if the line was abandoned with ^C, or -1 at end of input
+int read_line(int fd, char **out, size_t *length)
+{
+    bool status_quote = false,
+         escaped = false,     // Previous character was an unquoted-meaning backslash
+         started = false;     // Any input has been read for this line
+
+    line_length = 0;
+
+    while (true)
+    {
+        if (chunk_start == chunk_end)
+        {
+            ssize_t bytes = fill(fd, started);
+
+            if (bytes == -1 && errno == EINTR)
+            {
+                return 1;
+            }
+
+            if (bytes == -1)
+            {
+                perror("read() failed");
+                return -1;
+            }
+
+            // End of input, an unterminated line is still returned
+            if (bytes == 0)
+            {
+                if (!started)
+                    return -1;
+
+                break;
+            }
+        }
+
+        started = true;
+
+        char c = chunk[chunk_start++];
+
+        // [\] The backslash is kept for the tokeniser, unless it joins two lines
+        if (escaped)
+        {
+            escaped = false;
+
+            if (c == '\n')
+                continue;
+
+            if (line_put('\\') == -1 || line_put(c) == -1)
+                return -1;
+
+            continue;
+        }
+
+        if (c == '\\')
+        {
+            escaped = true;
+            continue;
+        }
+
+        if (c == '"')
+        {
+            status_quote = !status_quote;
+        }
+
+        // Unquoted newline ends the line
+        else if (c == '\n' && !status_quote)
+        {
+            break;
+        }
+
+        if (line_put(c) == -1)
+            return -1;
+    }
+
+    if (line_put('\0') == -1)
+        return -1;
+
+    *out = line;
+    *length = --line_length;
+
+    return 0;
+}
+
+// Whether only blank lines are left to read from fd. Only a regular file is read ahead,
+// a pipe or terminal may not have its next line yet
+bool input_exhausted(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return false;
+
+    while (true)
+    {
+        while (chunk_start < chunk_end && (chunk[chunk_start] == ' ' || chunk[chunk_start] == '\t' || chunk[chunk_start] == '\n'))
+            chunk_start++;
+
+        if (chunk_start < chunk_end)
+            return false;
+
+        ssize_t bytes = fill(fd, false);
+
+        if (bytes <= 0)
+            return bytes == 0;
+    }
+}
@@ -0,0 +1,406 @@
+/* --------------------------------------- limits.c --------------------------------------- */
+/* Provides the [limit] pipeline prefix. Resource limits are applied with setrlimit() in    */
+/* each child before execvp(), and cgroup v2 limits (memory.max, cpu.max, pids.max) by      */
+/* creating a leaf cgroup for the pipeline which every stage joins before execvp(). When    */
+/* the pipeline finishes, the cgroup's memory.peak and cpu.stat are reported and the leaf   */
+/* is removed.                                                                              */
+/*                                                                                          */
+/* limit [as=SIZE] [fsize=SIZE] [core=SIZE] [cputime=SECONDS] [nofile=N] [nproc=N]          */
+/*       [memory=SIZE] [cpu=CPUS] [pids=N] command ...                                      */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define RLIMIT_OPTIONS 6
+#define CPU_PERIOD 100000 // cpu.max period in microseconds
+#define MAX_LINE 256
+#define MAX_NAME 16 // Longer limit names are unknown anyway
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Single [name=value] option mapped onto setrlimit()
+typedef struct
+{
+    char *name;
+    int resource;
+    bool size; // Value accepts K/M/G suffixes
+} rlimit_option_t;
+
+rlimit_option_t rlimit_list[RLIMIT_OPTIONS] =
+    {
+        {"as", RLIMIT_AS, true},
+        {"fsize", RLIMIT_FSIZE, true},
+        {"core", RLIMIT_CORE, true},
+        {"cputime", RLIMIT_CPU, false},
+        {"nofile", RLIMIT_NOFILE, false},
+        {"nproc", RLIMIT_NPROC, false},
+};
+
+static int cgroup_count = 0; // Used to name leaf cgroups uniquely within the session
+
+/* --------------------------------------- PARSING --------------------------------------- */
+// Parse an integer with an optional K/M/G suffix, returns -1 if invalid or too large
+long long parse_size(const char *value, bool allow_suffix)
+{
+    char *end;
+    int shifts = 0; // Multiplications by 1024 for the suffix
+
+    errno = 0;
+    long long n = strtoll(value, &end, 10);
+
+    if (end == value || n < 0 || errno == ERANGE)
+        return -1;
+
+    if (allow_suffix && *end != '\0' && end[1] == '\0')
+    {
+        switch (*end)
+        {
+        case 'G':
+        case 'g':
+            shifts++;
+            /* fall through */
+        case 'M':
+        case 'm':
+            shifts++;
+            /* fall through */
+        case 'K':
+        case 'k':
+            shifts++;
+            end++;
+            break;
+        }
+    }
+
+    for (; shifts > 0; shifts--)
+    {
+        if (n > LLONG_MAX / 1024)
+            return -1;
+
+        n *= 1024;
+    }
+
+    return *end == '\0' ? n : -1;
+}
+
+// Parse [limit name=value ...] at the start of args. The words are left as they are, since
+// [bench] and [memo] run the same parsed pipeline again
+// Returns the number of words consumed, or -1 on error
+int parse_limit_prefix(char **args, pipeline_attr_t *attr)
+{
+    int a = 1;
+
+    for (; args[a] != NULL; a++)
+    {
+        char *equals = strchr(args[a], '=');
+
+        if (!equals)
+            break;
+
+        char name[MAX_NAME];
+        char *value = equals + 1;
+        bool found = false;
+
+        snprintf(name, sizeof(name), "%.*s", (int)(equals - args[a]), args[a]);
+
+        for (int i = 0; i < RLIMIT_OPTIONS && !found; i++)
+        {
+            if (strcmp(rlimit_list[i].name, name) == 0)
+            {
+                long long n = parse_size(value, rlimit_list[i].size);
+
+                if (n == -1 || attr->rlimit_count >= MAX_RLIMITS)
+                {
+                    fprintf(stderr, "limit: %s: invalid value [%s]\n", name, value);
+                    return -1;
+                }
+
+                attr->rlimits[attr->rlimit_count].resource = rlimit_list[i].resource;
+                attr->rlimits[attr->rlimit_count].value = n;
+                attr->rlimit_count++;
+                found = true;
+            }
+        }
+
+        if (found)
+            continue;
+
+        if (strcmp(name, "memory") == 0)
+        {
+            attr->memory_max = parse_size(value, true);
+        }
+
+        else if (strcmp(name, "pids") == 0)
+        {
+            attr->pids_max = parse_size(value, false);
+        }
+
+        else if (strcmp(name, "cpu") == 0)
+        {
+            char *end;
+            double cpus = strtod(value, &end);
+
+            attr->cpu_quota = (end == value || *end != '\0' || !(cpus > 0 && cpus < LLONG_MAX / CPU_PERIOD)) ? -1 : (long long)(cpus * CPU_PERIOD);
+        }
+
+        else
+        {
+            fprintf(stderr, "limit: %.*s: unknown limit\n", (int)(equals - args[a]), args[a]);
+            return -1;
+        }
+
+        if ((strcmp(name, "memory") == 0 && attr->memory_max == -1) ||
+            (strcmp(name, "pids") == 0 && attr->pids_max == -1) ||
+            (strcmp(name, "cpu") == 0 && attr->cpu_quota == -1))
+        {
+            fprintf(stderr, "limit: %s: invalid value [%s]\n", name, value);
+            return -1;
+        }
+    }
+
+    if (args[a] == NULL)
+    {
+        fprintf(stderr, "limit: command required\n");
+        return -1;
+    }
+
+    return a;
+}
+
+/* ---------------------------------------- CGROUP --------------------------------------- */
+// Write a single value to a cgroup interface file
+static int cgroup_write(const char *cgroup, const char *file, const char *value)
+{
+    char path[MAX_CGROUP_PATH + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return -1;
+
+    ssize_t written = write(fd, value, strlen(value));
+    int saved = errno;
+
+    close(fd);
+    errno = saved;
+
+    return written == -1 ? -1 : 0;
+}
+
+// Locate the directory of the shell's own cgroup in the cgroup v2 hierarchy
+static int cgroup_self(char *dst, size_t size)
+{
+    char line[MAX_LINE];
+    char mount[MAX_CGROUP_PATH] = "";
+    char self[MAX_CGROUP_PATH] = "";
+
+    // Mount point of the cgroup2 filesystem
+    FILE *mountinfo = fopen("/proc/self/mountinfo", "re");
+
+    if (!mountinfo)
+        return -1;
+
+    while (fgets(line, sizeof(line), mountinfo))
+    {
+        char *separator = strstr(line, " - cgroup2 ");
+        char point[MAX_CGROUP_PATH];
+
+        if (separator && sscanf(line, "%*s %*s %*s %*s %255s", point) == 1)
+        {
+            strcpy(mount, point);
+            break;
+        }
+    }
+
+    fclose(mountinfo);
+
+    // Unified hierarchy entry ("0::/path") of the shell process
+    FILE *cgroup = fopen("/proc/self/cgroup", "re");
+
+    if (!cgroup)
+        return -1;
+
+    while (fgets(line, sizeof(line), cgroup))
+    {
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(self, sizeof(self), "%s", line + 3);
+            break;
+        }
+    }
+
+    fclose(cgroup);
+
+    if (mount[0] == '\0' || self[0] == '\0')
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    snprintf(dst, size, "%s%s", mount, strcmp(self, "/") == 0 ? "" : self);
+    return 0;
+}
+
+// Create the pipeline's leaf cgroup and write its limits, called in the parent before fork()
+// The parent cgroup can be overridden with $TINYSHELL_CGROUP (it must delegate the controllers)
+int limits_prepare(pipeline_attr_t *attr)
+{
+    char parent[MAX_CGROUP_PATH - 32];
+
+    attr->cgroup[0] = '\0';
+
+    if (attr->memory_max < 0 && attr->cpu_quota < 0 && attr->pids_max < 0)
+        return 0;
+
+    if (getenv("TINYSHELL_CGROUP"))
+    {
+        snprintf(parent, sizeof(parent), "%s", getenv("TINYSHELL_CGROUP"));
+    }
+
+    else if (cgroup_self(parent, sizeof(parent)) == -1)
+    {
+        perror("limit: cgroup v2 hierarchy not found");
+        return -1;
+    }
+
+    // Enable the controllers needed for children of the parent cgroup (may already be
+    // enabled). A cgroup holding processes cannot: the shell's own cgroup usually does
+    char controllers[32];
+
+    snprintf(controllers, sizeof(controllers), "%s%s%s", attr->memory_max >= 0 ? " +memory" : "",
+             attr->cpu_quota >= 0 ? " +cpu" : "", attr->pids_max >= 0 ? " +pids" : "");
+
+    if (cgroup_write(parent, "cgroup.subtree_control", controllers + 1) == -1)
+    {
+        fprintf(stderr, "limit: cannot enable%s in %s: %s\n", controllers, parent, strerror(errno));
+        fprintf(stderr, "limit: delegate a subtree to the shell or set TINYSHELL_CGROUP to one\n");
+        return -1;
+    }
+
+    snprintf(attr->cgroup, sizeof(attr->cgroup), "%s/tinyshell.%d.%d", parent, getpid(), ++cgroup_count);
+
+    if (mkdir(attr->cgroup, 0755) == -1)
+    {
+        perror("limit: mkdir() cgroup failed");
+        attr->cgroup[0] = '\0';
+        return -1;
+    }
+
+    // Interface files left at their defaults are skipped
+    char memory[32], cpu[32], pids[32];
+    snprintf(memory, sizeof(memory), "%lld", attr->memory_max);
+    snprintf(cpu, sizeof(cpu), "%lld %d", attr->cpu_quota, CPU_PERIOD);
+    snprintf(pids, sizeof(pids), "%lld", attr->pids_max);
+
+    struct
+    {
+        char *file;
+        char *value;
+        bool set;
+    } writes[] = {
+        {"memory.max", memory, attr->memory_max >= 0},
+        {"cpu.max", cpu, attr->cpu_quota >= 0},
+        {"pids.max", pids, attr->pids_max >= 0},
+    };
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (writes[i].set && cgroup_write(attr->cgroup, writes[i].file, writes[i].value) == -1)
+        {
+            fprintf(stderr, "limit: %s: %s\n", writes[i].file, strerror(errno));
+            rmdir(attr->cgroup);
+            attr->cgroup[0] = '\0';
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Apply rlimits and join the pipeline's cgroup, called in the child before execvp()
+int limits_apply(pipeline_attr_t *attr)
+{
+    for (int i = 0; i < attr->rlimit_count; i++)
+    {
+        struct rlimit limit = {attr->rlimits[i].value, attr->rlimits[i].value};
+
+        if (setrlimit(attr->rlimits[i].resource, &limit) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (attr->cgroup[0] != '\0' && cgroup_write(attr->cgroup, "cgroup.procs", "0") == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Report memory.peak and cpu.stat of the pipeline's cgroup and remove it
+void limits_report(pipeline_attr_t *attr)
+{
+    if (attr->cgroup[0] == '\0')
+        return;
+
+    char path[MAX_CGROUP_PATH + 32];
+    char line[MAX_LINE];
+    long long peak = -1,
+              usage = -1,
+              user = -1,
+              system = -1;
+
+    snprintf(path, sizeof(path), "%s/memory.peak", attr->cgroup);
+    FILE *file = fopen(path, "re");
+
+    if (file)
+    {
+        if (fscanf(file, "%lld", &peak) != 1)
+            peak = -1;
+
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", attr->cgroup);
+    file = fopen(path, "re");
+
+    if (file)
+    {
+        while (fgets(line, sizeof(line), file))
+        {
+            sscanf(line, "usage_usec %lld", &usage);
+            sscanf(line, "user_usec %lld", &user);
+            sscanf(line, "system_usec %lld", &system);
+        }
+
+        fclose(file);
+    }
+
+    fprintf(stderr, "limit: memory.peak %lld KiB, cpu %.3fs (user %.3fs, sys %.3fs)\n",
+            peak < 0 ? -1 : peak / 1024, usage / 1e6, user / 1e6, system / 1e6);
+
+    limits_release(attr);
+}
+
+// Remove the pipeline's cgroup without reporting it, once no process is left in it
+void limits_release(pipeline_attr_t *attr)
+{
+    if (attr->cgroup[0] == '\0')
+        return;
+
+    if (rmdir(attr->cgroup) == -1)
+    {
+        perror("limit: rmdir() cgroup failed");
+    }
+
+    attr->cgroup[0] = '\0';
+}
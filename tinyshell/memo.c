@@ -0,0 +1,706 @@
+/* ---------------------------------------- memo.c ---------------------------------------- */
+/* Provides the [memo] prefix, which caches the STDOUT of a deterministic pipeline on disk  */
+/* ($XDG_CACHE_HOME/tinyshell/memo). The cache key holds the working directory, $PATH, the  */
+/* variables named with -e, the argv of every stage, and the identity (device, inode, size, */
+/* mtime) of every regular file named by an argument, by an input redirection or inherited  */
+/* by the first stage as STDIN. Other inherited input, such as a pipe, is never cached.     */
+/* Entries are named by the key's hash and hold the key itself, so a collision is a miss.   */
+/*                                                                                          */
+/* On a miss the last stage writes straight into a new entry, which is kept if every stage  */
+/* succeeded, and the output is then copied to STDOUT. On a hit the entry is copied to      */
+/* STDOUT without running anything, by copy_file_range() or sendfile() where the kernel     */
+/* allows it. Entries are evicted least recently used first once they exceed                */
+/* $TINYSHELL_MEMO_MAX (default 256M). [memo] alone shows hit and miss counts.              */
+/*                                                                                          */
+/* memo [-e NAME]... command ...          memo          memo -C                             */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define MEMO_DIRECTORY "tinyshell/memo"
+#define MEMO_SUFFIX ".out"
+#define STATS_FILE "stats"
+#define MEMO_MAGIC "TSM1"
+#define MEMO_VERSION 1
+#define DEFAULT_MEMO_MAX (256LL * 1024 * 1024)
+#define MAX_PATH 4096
+#define MIN_KEY 1024
+#define COPY_CHUNK 65536
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Entry header, followed by key_length bytes of key and output_length bytes of output
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key_length;
+    uint64_t output_length;
+} memo_header_t;
+
+// Counters shared by every shell, kept in STATS_FILE
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t replayed; // Bytes copied from the cache on hits
+} memo_counters_t;
+
+// Cache key being built
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} memo_key_t;
+
+// Entry considered for eviction
+typedef struct
+{
+    char name[32];
+    off_t size;
+    struct timespec used;
+} memo_file_t;
+
+/* --------------------------------------- PARSING --------------------------------------- */
+// Parse [memo [-e NAME]...] at the start of args
+// Returns the number of words consumed, 0 if [memo] is used alone (the builtin), or -1
+int parse_memo_prefix(char **args, pipeline_attr_t *attr)
+{
+    int a = 1;
+
+    if (!args[a] || strcmp(args[a], "-C") == 0)
+        return 0;
+
+    attr->memo = true;
+
+    for (; args[a] && strcmp(args[a], "-e") == 0; a += 2)
+    {
+        if (!args[a + 1])
+        {
+            fprintf(stderr, "memo: -e: variable name required\n");
+            return -1;
+        }
+
+        if (attr->memo_env_count == MAX_MEMO_ENV)
+        {
+            fprintf(stderr, "memo: too many variables (max %d)\n", MAX_MEMO_ENV);
+            return -1;
+        }
+
+        attr->memo_env[attr->memo_env_count++] = args[a + 1];
+    }
+
+    if (!args[a])
+    {
+        fprintf(stderr, "memo: command required\n");
+        return -1;
+    }
+
+    return a;
+}
+
+/* ------------------------------------------ KEY ---------------------------------------- */
+static int key_append(memo_key_t *key, const void *data, size_t length)
+{
+    if (key->length + length > key->capacity)
+    {
+        size_t capacity = key->capacity ? key->capacity : MIN_KEY;
+
+        while (capacity < key->length + length)
+            capacity *= 2;
+
+        char *grown = realloc(key->data, capacity);
+
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
+
+        key->data = grown;
+        key->capacity = capacity;
+    }
+
+    memcpy(key->data + key->length, data, length);
+    key->length += length;
+    return 0;
+}
+
+static int key_string(memo_key_t *key, const char *s)
+{
+    return key_append(key, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static int key_identity(memo_key_t *key, const struct stat *st)
+{
+    uint64_t identity[5] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+
+    return key_append(key, identity, sizeof(identity));
+}
+
+// Identity of a regular file, so the entry is not used once it changes
+// Files which do not exist are left out, returns 0, or -1 if memory could not be allocated
+static int key_file(memo_key_t *key, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return 0;
+
+    return key_string(key, path) == -1 ? -1 : key_identity(key, &st);
+}
+
+// What the first stage reads when it inherits the shell's STDIN
+typedef enum
+{
+    STDIN_NONE,   // Redirected, a terminal or /dev/null: nothing to key
+    STDIN_FILE,   // A regular file, keyed by its identity
+    STDIN_STREAM  // A pipe, socket or device, whose contents cannot be keyed
+} stdin_kind_t;
+
+static stdin_kind_t shell_stdin(redirect_t *redirects, int redirect_count, struct stat *st)
+{
+    struct stat null;
+
+    for (int i = 0; i < redirect_count; i++)
+    {
+        if (redirects[i].stage == 0 && redirects[i].fd == STDIN_FILENO)
+            return STDIN_NONE;
+    }
+
+    if (isatty(STDIN_FILENO) || fstat(STDIN_FILENO, st) == -1)
+        return STDIN_NONE;
+
+    if (S_ISREG(st->st_mode))
+        return STDIN_FILE;
+
+    if (S_ISCHR(st->st_mode) && stat("/dev/null", &null) == 0 && st->st_rdev == null.st_rdev)
+        return STDIN_NONE;
+
+    return STDIN_STREAM;
+}
+
+// Build the cache key of a pipeline, returns 0, or -1 on error
+static int build_key(memo_key_t *key, int argc, char **pipeline[], const pipe_link_t *links,
+                     redirect_t *redirects, int redirect_count, pipeline_attr_t *attr)
+{
+    char cwd[MAX_PATH];
+
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        perror("getcwd() failed");
+        return -1;
+    }
+
+    if (key_string(key, cwd) == -1 || key_string(key, getenv("PATH")) == -1)
+        return -1;
+
+    for (int i = 0; i < attr->memo_env_count; i++)
+    {
+        const char *value = getenv(attr->memo_env[i]);
+
+        // An unset variable differs from an empty one
+        if (key_string(key, attr->memo_env[i]) == -1 || key_append(key, value ? "=" : "!", 1) == -1 ||
+            key_string(key, value) == -1)
+            return -1;
+    }
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (key_append(key, links && links[i] == LINK_FANOUT ? "*" : "|", 1) == -1)
+            return -1;
+
+        for (char **arg = pipeline[i]; *arg; arg++)
+        {
+            if (key_string(key, *arg) == -1 || key_file(key, *arg) == -1)
+                return -1;
+        }
+    }
+
+    // A first stage reading the shell's STDIN from a file depends on that file
+    struct stat st;
+
+    if (shell_stdin(redirects, redirect_count, &st) == STDIN_FILE &&
+        (key_append(key, "<", 1) == -1 || key_identity(key, &st) == -1))
+        return -1;
+
+    for (int i = 0; i < redirect_count; i++)
+    {
+        redirect_t *r = &redirects[i];
+        int fields[4] = {r->stage, r->fd, r->type, r->source};
+
+        if (key_append(key, fields, sizeof(fields)) == -1)
+            return -1;
+
+        if (r->type != REDIRECT_DUPLICATE && r->type != REDIRECT_CLOSE &&
+            (key_string(key, r->path) == -1 || key_file(key, r->path) == -1))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------- FILES ---------------------------------------- */
+// Path of the cache directory, created along with its parents when create is set
+static int memo_directory(char *path, size_t size, bool create)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int length;
+
+    if (cache && *cache)
+        length = snprintf(path, size, "%s/%s", cache, MEMO_DIRECTORY);
+    else if (home)
+        length = snprintf(path, size, "%s/.cache/%s", home, MEMO_DIRECTORY);
+    else
+        return -1;
+
+    if (length >= (int)size)
+        return -1;
+
+    for (char *slash = create ? strchr(path + 1, '/') : NULL; slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+
+    if (create && mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
+
+// Add delta to the counters shared by every shell
+static void count(const memo_counters_t *delta)
+{
+    char path[MAX_PATH];
+
+    if (memo_directory(path, sizeof(path) - sizeof(STATS_FILE) - 1, true) == -1)
+        return;
+
+    strcat(path, "/" STATS_FILE);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1)
+        return;
+
+    memo_counters_t counters = {0};
+
+    if (flock(fd, LOCK_EX) == 0 && pread(fd, &counters, sizeof(counters), 0) >= 0)
+    {
+        counters.hits += delta->hits;
+        counters.misses += delta->misses;
+        counters.evictions += delta->evictions;
+        counters.replayed += delta->replayed;
+
+        pwrite(fd, &counters, sizeof(counters), 0);
+    }
+
+    close(fd);
+}
+
+// Copy length bytes at offset of fd to STDOUT, through the kernel where it allows it
+static int replay(int fd, off_t offset, size_t length)
+{
+    char buffer[COPY_CHUNK];
+    bool copy_range = true, send = true;
+
+    fflush(stdout);
+
+    while (length > 0)
+    {
+        ssize_t n = -1;
+
+        // Regular file to regular file: no copy at all on filesystems sharing extents
+        if (copy_range)
+        {
+            n = copy_file_range(fd, &offset, STDOUT_FILENO, NULL, length, 0);
+            copy_range = n != -1;
+        }
+
+        // Anything that accepts splice(), such as a pipe
+        if (n == -1 && send)
+        {
+            n = sendfile(STDOUT_FILENO, fd, &offset, length);
+            send = n != -1;
+        }
+
+        // Anything else, such as a terminal
+        if (n == -1)
+        {
+            n = pread(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+
+            if (n > 0)
+                n = write(STDOUT_FILENO, buffer, n);
+
+            if (n > 0)
+                offset += n;
+        }
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return -1;
+
+        length -= n;
+    }
+
+    return 0;
+}
+
+// Open the entry at path if it holds key. Returns its descriptor, or -1 on a miss
+static int lookup(const char *path, const memo_key_t *key, memo_header_t *header)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return -1;
+
+    char *stored = malloc(key->length);
+
+    bool hit = stored &&
+               pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+               memcmp(header->magic, MEMO_MAGIC, 4) == 0 && header->version == MEMO_VERSION &&
+               header->key_length == key->length &&
+               pread(fd, stored, key->length, sizeof(*header)) == (ssize_t)key->length &&
+               memcmp(stored, key->data, key->length) == 0;
+
+    free(stored);
+
+    if (!hit)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int compare_used(const void *a, const void *b)
+{
+    const struct timespec *x = &((const memo_file_t *)a)->used,
+                          *y = &((const memo_file_t *)b)->used;
+
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// List the entries of the cache directory, returns the number found, or -1 on error
+static int list_entries(const char *directory, memo_file_t **files, long long *total)
+{
+    DIR *dir = opendir(directory);
+    int count = 0, capacity = 0;
+
+    *files = NULL;
+    *total = 0;
+
+    if (!dir)
+        return -1;
+
+    for (struct dirent *d; (d = readdir(dir));)
+    {
+        size_t length = strlen(d->d_name);
+        struct stat st;
+
+        if (length <= strlen(MEMO_SUFFIX) || length >= sizeof((*files)->name) ||
+            strcmp(d->d_name + length - strlen(MEMO_SUFFIX), MEMO_SUFFIX) != 0 ||
+            fstatat(dirfd(dir), d->d_name, &st, 0) == -1)
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            memo_file_t *grown = realloc(*files, capacity * sizeof(**files));
+
+            if (!grown)
+            {
+                perror("realloc() failed");
+                break;
+            }
+
+            *files = grown;
+        }
+
+        memo_file_t *file = &(*files)[count++];
+
+        strcpy(file->name, d->d_name);
+        file->size = st.st_size;
+        file->used = st.st_mtim;
+        *total += st.st_size;
+    }
+
+    closedir(dir);
+    return count;
+}
+
+// Remove the least recently used entries until the cache fits in $TINYSHELL_MEMO_MAX
+static int evict(const char *directory)
+{
+    const char *max_value = getenv("TINYSHELL_MEMO_MAX");
+    long long max = max_value ? parse_size(max_value, true) : DEFAULT_MEMO_MAX;
+    long long total;
+    char path[MAX_PATH + 32];
+    memo_file_t *files;
+    int evicted = 0;
+
+    if (max < 0)
+        max = DEFAULT_MEMO_MAX;
+
+    int count = list_entries(directory, &files, &total);
+
+    if (count <= 0 || total <= max)
+    {
+        free(files);
+        return 0;
+    }
+
+    qsort(files, count, sizeof(*files), compare_used);
+
+    for (int i = 0; i < count && total > max; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i].name);
+
+        if (unlink(path) == 0)
+        {
+            total -= files[i].size;
+            evicted++;
+        }
+    }
+
+    free(files);
+    return evicted;
+}
+
+/* --------------------------------------- RUNNING --------------------------------------- */
+// Whether the pipeline's output can be cached: only the last stage may write to STDOUT
+static bool cacheable(int argc, const pipe_link_t *links, redirect_t *redirects, int redirect_count, int substitution_count)
+{
+    if (substitution_count > 0)
+    {
+        fprintf(stderr, "memo: process substitutions are not cached\n");
+        return false;
+    }
+
+    for (int i = 1; links && i < argc; i++)
+    {
+        if (links[i] == LINK_FANOUT)
+        {
+            fprintf(stderr, "memo: fan-out pipelines are not cached\n");
+            return false;
+        }
+    }
+
+    for (int i = 0; i < redirect_count; i++)
+    {
+        if (redirects[i].stage == argc - 1 && redirects[i].fd == STDOUT_FILENO)
+        {
+            fprintf(stderr, "memo: redirected output is not cached\n");
+            return false;
+        }
+    }
+
+    struct stat st;
+
+    if (shell_stdin(redirects, redirect_count, &st) == STDIN_STREAM)
+    {
+        fprintf(stderr, "memo: standard input is not cached\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Replay the pipeline's output from the cache, or run it with its last stage writing into a
+// new entry. Returns the pipeline's exit status, or -1 on error
+int memo_pipeline(int argc, char **pipeline[], const pipe_link_t *links, redirect_t *redirects, int redirect_count,
+                  substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr)
+{
+    char directory[MAX_PATH], path[MAX_PATH + 32], temporary[MAX_PATH + 64];
+    memo_key_t key = {NULL, 0, 0};
+    memo_header_t header;
+
+    if (!cacheable(argc, links, redirects, redirect_count, substitution_count) ||
+        build_key(&key, argc, pipeline, links, redirects, redirect_count, attr) == -1 ||
+        memo_directory(directory, sizeof(directory), true) == -1)
+    {
+        free(key.data);
+        return execute_pipeline(argc, pipeline, links, false, redirects, redirect_count, substitutions, substitution_count, attr);
+    }
+
+    snprintf(path, sizeof(path), "%s/%016llx" MEMO_SUFFIX, directory, (unsigned long long)fnv1a(key.data, key.length));
+
+    /* HIT */
+    int fd = lookup(path, &key, &header);
+
+    if (fd != -1)
+    {
+        int statuses[argc];
+
+        // The entry's mtime orders eviction
+        futimens(fd, NULL);
+
+        int replayed = replay(fd, sizeof(header) + key.length, header.output_length);
+        close(fd);
+        free(key.data);
+
+        memset(statuses, 0, sizeof(statuses));
+        record_status(statuses, argc);
+        count(&(memo_counters_t){.hits = 1, .replayed = header.output_length});
+
+        return replayed == -1 ? -1 : EXIT_SUCCESS;
+    }
+
+    /* MISS */
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid());
+    fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    header = (memo_header_t){.magic = MEMO_MAGIC, .version = MEMO_VERSION, .key_length = key.length};
+
+    if (fd == -1 || write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, key.data, key.length) != (ssize_t)key.length)
+    {
+        perror("memo: cache entry");
+
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(temporary);
+        }
+
+        free(key.data);
+        return execute_pipeline(argc, pipeline, links, false, redirects, redirect_count, substitutions, substitution_count, attr);
+    }
+
+    // The last stage's STDOUT goes to the entry, before the stage's own redirections so
+    // [2>&1] follows it
+    redirect_t *with_output = malloc((redirect_count + 1) * sizeof(*with_output));
+
+    if (!with_output)
+    {
+        perror("malloc() failed");
+        close(fd);
+        unlink(temporary);
+        free(key.data);
+        return -1;
+    }
+
+    with_output[0] = (redirect_t){.stage = argc - 1, .fd = STDOUT_FILENO, .type = REDIRECT_DUPLICATE, .path = NULL, .source = fd};
+    memcpy(with_output + 1, redirects, redirect_count * sizeof(*redirects));
+
+    int status = execute_pipeline(argc, pipeline, links, false, with_output, redirect_count + 1, substitutions, substitution_count, attr);
+    free(with_output);
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    header.output_length = end - sizeof(header) - key.length;
+
+    replay(fd, sizeof(header) + key.length, header.output_length);
+
+    // Only output of a pipeline whose every stage succeeded is kept
+    bool succeeded = status == EXIT_SUCCESS;
+
+    for (int i = 0; i < pipe_status_count; i++)
+    {
+        succeeded &= pipe_status[i] == EXIT_SUCCESS;
+    }
+
+    if (succeeded && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && rename(temporary, path) == 0)
+    {
+        count(&(memo_counters_t){.misses = 1, .evictions = evict(directory)});
+    }
+
+    else
+    {
+        unlink(temporary);
+        count(&(memo_counters_t){.misses = 1});
+    }
+
+    close(fd);
+    free(key.data);
+    return status;
+}
+
+/* ---------------------------------------- STATS ---------------------------------------- */
+// [memo] Counters shared by every shell, and the size of the cache
+void memo_stats(void)
+{
+    char directory[MAX_PATH], path[MAX_PATH + 8];
+    memo_counters_t counters = {0};
+    memo_file_t *files;
+    long long total;
+
+    if (memo_directory(directory, sizeof(directory), false) == -1)
+        return;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, STATS_FILE);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd != -1)
+    {
+        if (pread(fd, &counters, sizeof(counters), 0) != sizeof(counters))
+            memset(&counters, 0, sizeof(counters));
+
+        close(fd);
+    }
+
+    int count = list_entries(directory, &files, &total);
+    const char *max = getenv("TINYSHELL_MEMO_MAX");
+    uint64_t lookups = counters.hits + counters.misses;
+
+    printf("entries     %d\n", count > 0 ? count : 0);
+    printf("size        %lld (max %s)\n", total, max ? max : "256M");
+    printf("hits        %llu", (unsigned long long)counters.hits);
+
+    if (lookups > 0)
+        printf(" (%.1f%%)", 100.0 * counters.hits / lookups);
+
+    printf("\n");
+    printf("misses      %llu\n", (unsigned long long)counters.misses);
+    printf("evictions   %llu\n", (unsigned long long)counters.evictions);
+    printf("replayed    %llu bytes\n", (unsigned long long)counters.replayed);
+
+    free(files);
+}
+
+// [memo -C] Remove every entry and reset the counters, returns 0, or -1 on error
+int memo_clear(void)
+{
+    char directory[MAX_PATH], path[MAX_PATH + 32];
+    memo_file_t *files;
+    long long total;
+
+    if (memo_directory(directory, sizeof(directory), false) == -1)
+        return -1;
+
+    int count = list_entries(directory, &files, &total);
+
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i].name);
+        unlink(path);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", directory, STATS_FILE);
+    unlink(path);
+
+    free(files);
+    return 0;
+}
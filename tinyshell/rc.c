@@ -0,0 +1,476 @@
+/* ----------------------------------------- rc.c ----------------------------------------- */
+/* Provides the rc file (~/.tinyshellrc, or $TINYSHELLRC) which is run at startup, and the  */
+/* alias table. An rc file made only of [export], [alias] and [set] lines (and comments)    */
+/* leaves nothing but state behind, which is saved into a versioned snapshot keyed by the   */
+/* rc file's mtime, size and hash. Each rc file has its own snapshot, named by the hash of  */
+/* its path ($XDG_CACHE_HOME/tinyshell/rc.HASH.snapshot). Later shells mmap() the snapshot  */
+/* and apply it without reading the rc file at all; if only the mtime changed, the rc file  */
+/* is hashed and the snapshot is still used when the hash matches. An rc file with any      */
+/* other command is run line by line on every start.                                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define RC_FILE ".tinyshellrc"
+#define SNAPSHOT_DIRECTORY "tinyshell"
+#define SNAPSHOT_FILE "rc.%016llx.snapshot" // Named by the hash of the rc file's path
+#define SNAPSHOT_MAGIC "TSRC"
+#define SNAPSHOT_VERSION 3
+#define MAX_PATH 4096
+#define MIN_ALIASES 8
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Snapshot header, followed by env_count [NAME\0VALUE\0] then alias_count [name\0value\0]
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t rc_mtime; // Nanoseconds
+    uint64_t rc_size;
+    uint64_t rc_hash; // FNV-1a of the rc file
+    uint64_t scrollback; // Bytes kept by scrollback
+    uint32_t options; // options_saved(), one bit per shell option
+    uint32_t env_count;
+    uint32_t alias_count;
+    uint32_t data_length;
+} snapshot_header_t;
+
+// Single alias, [alias name=value]
+typedef struct
+{
+    char *name;
+    char *value;
+} alias_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static alias_t *aliases = NULL;
+static int alias_count = 0,
+           alias_capacity = 0;
+
+static bool loading_rc = false; // Exports are only remembered while the rc file runs
+static char **exported = NULL;
+static int exported_count = 0;
+
+/* --------------------------------------- ALIASES --------------------------------------- */
+const char *alias_lookup(const char *name)
+{
+    for (int i = 0; i < alias_count; i++)
+    {
+        if (strcmp(aliases[i].name, name) == 0)
+            return aliases[i].value;
+    }
+
+    return NULL;
+}
+
+// Define or replace an alias, returns 0, or -1 if memory could not be allocated
+int alias_set(const char *name, const char *value)
+{
+    char *copy = strdup(value);
+
+    if (!copy)
+        return -1;
+
+    for (int i = 0; i < alias_count; i++)
+    {
+        if (strcmp(aliases[i].name, name) == 0)
+        {
+            free(aliases[i].value);
+            aliases[i].value = copy;
+            return 0;
+        }
+    }
+
+    if (alias_count == alias_capacity)
+    {
+        int capacity = alias_capacity ? alias_capacity * 2 : MIN_ALIASES;
+        alias_t *grown = realloc(aliases, capacity * sizeof(*aliases));
+
+        if (!grown)
+        {
+            free(copy);
+            return -1;
+        }
+
+        aliases = grown;
+        alias_capacity = capacity;
+    }
+
+    if (!(aliases[alias_count].name = strdup(name)))
+    {
+        free(copy);
+        return -1;
+    }
+
+    aliases[alias_count++].value = copy;
+    return 0;
+}
+
+void alias_print(const char *name)
+{
+    for (int i = 0; i < alias_count; i++)
+    {
+        if (!name || strcmp(aliases[i].name, name) == 0)
+            printf("alias %s=%s\n", aliases[i].name, aliases[i].value);
+    }
+}
+
+// Remember a variable exported by the rc file, so the snapshot can restore it
+void rc_note_export(const char *name)
+{
+    if (!loading_rc)
+        return;
+
+    for (int i = 0; i < exported_count; i++)
+    {
+        if (strcmp(exported[i], name) == 0)
+            return;
+    }
+
+    char **grown = realloc(exported, (exported_count + 1) * sizeof(*exported));
+
+    if (!grown || !(grown[exported_count] = strdup(name)))
+    {
+        exported = grown ? grown : exported;
+        return;
+    }
+
+    exported = grown;
+    exported_count++;
+}
+
+/* -------------------------------------- UTILITIES -------------------------------------- */
+// FNV-1a hash, also used by the frecency index (frecency.c)
+uint64_t fnv1a(const char *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t mtime_of(const struct stat *st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Path of the rc file, returns -1 if there is none to look for
+static int rc_path(char *path, size_t size)
+{
+    const char *custom = getenv("TINYSHELLRC");
+    const char *home = getenv("HOME");
+
+    if (custom)
+        return snprintf(path, size, "%s", custom) < (int)size ? 0 : -1;
+
+    if (!home)
+        return -1;
+
+    return snprintf(path, size, "%s/%s", home, RC_FILE) < (int)size ? 0 : -1;
+}
+
+// Path of the snapshot of the rc file at rc, its directory is created when create is set
+// Each rc file has its own, so shells started with different $TINYSHELLRC do not keep
+// replacing each other's snapshot
+static int snapshot_path(char *path, size_t size, const char *rc, bool create)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char directory[MAX_PATH];
+
+    if (cache && *cache)
+        snprintf(directory, sizeof(directory), "%s", cache);
+    else if (home)
+        snprintf(directory, sizeof(directory), "%s/.cache", home);
+    else
+        return -1;
+
+    if (create)
+        mkdir(directory, 0700);
+
+    size_t length = strlen(directory);
+    snprintf(directory + length, sizeof(directory) - length, "/%s", SNAPSHOT_DIRECTORY);
+
+    if (create && mkdir(directory, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    char resolved[PATH_MAX];
+    const char *key = realpath(rc, resolved) ? resolved : rc;
+    unsigned long long hash = fnv1a(key, strlen(key));
+
+    return snprintf(path, size, "%s/" SNAPSHOT_FILE, directory, hash) < (int)size ? 0 : -1;
+}
+
+// Whether a line only changes state restored by the snapshot
+static bool is_cacheable(const char *line, size_t length)
+{
+    size_t c = 0;
+
+    while (c < length && (line[c] == ' ' || line[c] == '\t'))
+        c++;
+
+    // Blank line or comment
+    if (c == length || line[c] == '#')
+        return true;
+
+    // Anything else on the line (a second command, a pipe, a redirection) may have effects
+    for (size_t i = c; i < length; i++)
+    {
+        if (line[i] == ';' || line[i] == '|' || line[i] == '&' || line[i] == '<' || line[i] == '>' || line[i] == '$')
+            return false;
+    }
+
+    // [set -o trace=FILE] opens a file, which the snapshot does not restore
+    if (strstr(line, "trace"))
+        return false;
+
+    const char *cacheable[] = {"export ", "alias ", "set "};
+
+    for (size_t i = 0; i < sizeof(cacheable) / sizeof(*cacheable); i++)
+    {
+        size_t prefix = strlen(cacheable[i]);
+
+        if (length - c > prefix && strncmp(line + c, cacheable[i], prefix) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* -------------------------------------- SNAPSHOT --------------------------------------- */
+// Apply a snapshot mapped at data, returns 0, or -1 if it is malformed
+static int apply_snapshot(const char *data, size_t size)
+{
+    const snapshot_header_t *header = (const snapshot_header_t *)data;
+    const char *cursor = data + sizeof(*header),
+               *end = data + size;
+
+    for (uint32_t i = 0; i < 2 * (header->env_count + header->alias_count); i += 2)
+    {
+        const char *name = cursor;
+        const char *name_end = memchr(name, '\0', end - name);
+
+        if (!name_end)
+            return -1;
+
+        const char *value = name_end + 1;
+        const char *value_end = value < end ? memchr(value, '\0', end - value) : NULL;
+
+        if (!value_end)
+            return -1;
+
+        if (i < 2 * header->env_count)
+            setenv(name, value, 1);
+        else
+            alias_set(name, value);
+
+        cursor = value_end + 1;
+    }
+
+    options_restore(header->options);
+    scrollback_limit(header->scrollback);
+
+    return 0;
+}
+
+// Load the snapshot if it matches the rc file, hashing it only if its mtime changed
+// Returns 0 if the snapshot was applied, or -1 if the rc file has to be run
+static int load_snapshot(const char *rc, const struct stat *rc_stat)
+{
+    char path[MAX_PATH];
+    struct stat st;
+
+    if (snapshot_path(path, sizeof(path), rc, false) == -1)
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(snapshot_header_t))
+    {
+        close(fd);
+        return -1;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return -1;
+
+    const snapshot_header_t *header = (const snapshot_header_t *)data;
+    int result = -1;
+
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0 &&
+                 header->version == SNAPSHOT_VERSION &&
+                 header->data_length == st.st_size - sizeof(*header) &&
+                 header->rc_size == (uint64_t)rc_stat->st_size;
+
+    // Same size but touched: compare contents through the hash
+    if (valid && header->rc_mtime != mtime_of(rc_stat))
+    {
+        valid = false;
+        int rc_fd = open(rc, O_RDONLY | O_CLOEXEC);
+
+        if (rc_fd != -1)
+        {
+            char *contents = rc_stat->st_size ? mmap(NULL, rc_stat->st_size, PROT_READ, MAP_PRIVATE, rc_fd, 0) : NULL;
+
+            if (contents != MAP_FAILED)
+            {
+                valid = fnv1a(contents, rc_stat->st_size) == header->rc_hash;
+
+                if (contents)
+                    munmap(contents, rc_stat->st_size);
+            }
+
+            close(rc_fd);
+        }
+    }
+
+    if (valid)
+        result = apply_snapshot(data, st.st_size);
+
+    munmap(data, st.st_size);
+    return result;
+}
+
+// Save the state left by the rc file, written to a temporary file and renamed into place
+static void save_snapshot(const char *rc, const struct stat *rc_stat, uint64_t hash)
+{
+    char path[MAX_PATH], temporary[MAX_PATH + 32];
+
+    if (snapshot_path(path, sizeof(path), rc, true) == -1)
+        return;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid());
+
+    FILE *file = fopen(temporary, "we");
+
+    if (!file)
+        return;
+
+    snapshot_header_t header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .rc_mtime = mtime_of(rc_stat),
+        .rc_size = rc_stat->st_size,
+        .rc_hash = hash,
+        .scrollback = scrollback_size(),
+        .options = options_saved(),
+        .env_count = 0,
+        .alias_count = alias_count,
+        .data_length = 0};
+
+    // Data is written after a placeholder header, which is rewritten with the counts
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (int i = 0; i < exported_count; i++)
+    {
+        const char *value = getenv(exported[i]);
+
+        if (!value)
+            continue;
+
+        fwrite(exported[i], strlen(exported[i]) + 1, 1, file);
+        fwrite(value, strlen(value) + 1, 1, file);
+        header.env_count++;
+        header.data_length += strlen(exported[i]) + strlen(value) + 2;
+    }
+
+    for (int i = 0; i < alias_count; i++)
+    {
+        fwrite(aliases[i].name, strlen(aliases[i].name) + 1, 1, file);
+        fwrite(aliases[i].value, strlen(aliases[i].value) + 1, 1, file);
+        header.data_length += strlen(aliases[i].name) + strlen(aliases[i].value) + 2;
+    }
+
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+
+    if (fclose(file) != 0 || rename(temporary, path) == -1)
+        unlink(temporary);
+}
+
+/* ---------------------------------------- LOADING -------------------------------------- */
+// Run the rc file, or apply its snapshot. Returns 0, or -1 if it could not be read
+int rc_load(void)
+{
+    char path[MAX_PATH];
+    struct stat st;
+
+    if (rc_path(path, sizeof(path)) == -1 || stat(path, &st) == -1)
+        return 0;
+
+    if (load_snapshot(path, &st) == 0)
+        return 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *contents = malloc(st.st_size + 1);
+
+    if (fd == -1 || !contents || read(fd, contents, st.st_size) != st.st_size)
+    {
+        fprintf(stderr, "tinyshell: ");
+        perror(path);
+
+        if (fd != -1)
+            close(fd);
+
+        free(contents);
+        return -1;
+    }
+
+    close(fd);
+    contents[st.st_size] = '\0';
+
+    uint64_t hash = fnv1a(contents, st.st_size);
+    bool cacheable = true;
+    loading_rc = true;
+
+    // Lines are run in order, a failing line does not stop the rest
+    for (char *line = contents; line < contents + st.st_size;)
+    {
+        char *end = memchr(line, '\n', contents + st.st_size - line);
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+
+        line[length] = '\0';
+
+        if (!is_cacheable(line, length))
+            cacheable = false;
+
+        size_t c = 0;
+
+        while (c < length && (line[c] == ' ' || line[c] == '\t'))
+            c++;
+
+        if (c < length && line[c] != '#')
+            execute_line(line, length);
+
+        line += length + 1;
+    }
+
+    loading_rc = false;
+
+    if (cacheable)
+        save_snapshot(path, &st, hash);
+
+    free(contents);
+    return 0;
+}
@@ -1,21 +1,50 @@
 /* ------------------------------------ redirection.c  ------------------------------------ */
 /* Provides the redirect_input() and redirect_output() functions for I/O redirecton when    */
-/* executing commands                                                                       */
+/* executing commands, and apply_redirects() for redirections of any file descriptor        */
+/* ([2>], [2>>], [N>&M], [&>], [N<>]). Files are opened with O_CLOEXEC, only the dup2()ed   */
+/* descriptor is inherited by the command.                                                  */
+/* [<z file] [>z file] [>>z file] connect the descriptor to a pipe fed or drained by a      */
+/* helper thread of the shell (inprocess.c), which (de)compresses the file with zlib or     */
+/* libzstd. Input is decoded by its magic bytes and passed through if it is neither; output */
+/* is zstd for a [.zst] path and gzip otherwise. Codecs are built in when the library was   */
+/* found (HAVE_ZLIB, HAVE_ZSTD).                                                            */
 /* Adapted from Keith Bugeja's "CPS1012 - Redirection and Pipes Part 1 (I/O Redirection)"   */
 /* https://www.youtube.com/watch?v=XflfgbUiHYI                                              */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "tinyshell.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+#define Z_CHUNK (64 * 1024) // Bytes read or written at once by the compression helpers
+
 int reopen(int fd, char *pathname, int flags, mode_t mode)
 {
-    int open_fd = open(pathname, flags, mode);
-    if (open_fd == fd || open_fd < 0)
+    int open_fd = open(pathname, flags | O_CLOEXEC, mode);
+    if (open_fd < 0)
         return open_fd;
 
+    // Opened straight onto fd (it was closed), clear O_CLOEXEC so the command inherits it
+    if (open_fd == fd)
+        return fcntl(fd, F_SETFD, 0) == -1 ? -1 : fd;
+
     int dup_fd = dup2(open_fd, fd);
 
     if (close(open_fd) == -1)
@@ -34,5 +63,580 @@ int redirect_input(char *input)
 
 int redirect_output(char *output, int append_flag)
 {
-    return reopen(STDOUT_FILENO, output, append_flag | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    return reopen(STDOUT_FILENO, output, append_flag | O_CREAT, FILE_MODE);
+}
+
+// Apply the redirections of the given stage in order, called in the child
+// *max_fd is raised to the highest file descriptor redirected. Returns 0, or -1 on error
+// with errno set and *failed set to the index of the redirection which failed
+int apply_redirects(redirect_t *redirects, int count, int stage, int *max_fd, int *failed)
+{
+    for (int i = 0; i < count; i++)
+    {
+        redirect_t *r = &redirects[i];
+        int result = 0;
+
+        if (r->stage != stage)
+            continue;
+
+        switch (r->type)
+        {
+        case REDIRECT_INPUT:
+            result = reopen(r->fd, r->path, O_RDONLY, S_IRUSR);
+            break;
+
+        case REDIRECT_OUTPUT:
+            result = reopen(r->fd, r->path, O_WRONLY | O_CREAT | O_TRUNC, FILE_MODE);
+            break;
+
+        case REDIRECT_APPEND:
+            result = reopen(r->fd, r->path, O_WRONLY | O_CREAT | O_APPEND, FILE_MODE);
+            break;
+
+        case REDIRECT_READ_WRITE:
+            result = reopen(r->fd, r->path, O_RDWR | O_CREAT, FILE_MODE);
+            break;
+
+        case REDIRECT_DUPLICATE:
+        case REDIRECT_INPUT_Z:
+        case REDIRECT_OUTPUT_Z:
+        case REDIRECT_APPEND_Z:
+            result = r->source == r->fd ? fcntl(r->fd, F_SETFD, 0) : dup2(r->source, r->fd);
+            break;
+
+        case REDIRECT_CLOSE:
+            close(r->fd);
+            break;
+        }
+
+        if (result == -1)
+        {
+            *failed = i;
+            return -1;
+        }
+
+        if (r->fd > *max_fd)
+            *max_fd = r->fd;
+    }
+
+    return 0;
+}
+
+// Report a redirection which apply_redirects() could not apply
+void redirect_error(const redirect_t *redirect, int error)
+{
+    fprintf(stderr, "tinyshell: %s: %s\n", redirect->path ? redirect->path : "dup2() failed", strerror(error));
+}
+
+/* ------------------------------------- COMPRESSION ------------------------------------- */
+// Format of a compressed redirection's file
+typedef enum
+{
+    CODEC_PLAIN, // Input only: neither magic number, copied as is
+    CODEC_GZIP,
+    CODEC_ZSTD
+} codec_t;
+
+static const char *codec_names[] = {"plain", "gzip", "zstd"};
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+static bool codec_built_in(codec_t codec)
+{
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_GZIP)
+        return true;
+#endif
+
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD)
+        return true;
+#endif
+
+    return codec == CODEC_PLAIN;
+}
+
+// Codec of the data starting with the n bytes in buffer
+static codec_t input_codec(const unsigned char *buffer, size_t n)
+{
+    if (n >= sizeof(gzip_magic) && memcmp(buffer, gzip_magic, sizeof(gzip_magic)) == 0)
+        return CODEC_GZIP;
+
+    if (n >= sizeof(zstd_magic) && memcmp(buffer, zstd_magic, sizeof(zstd_magic)) == 0)
+        return CODEC_ZSTD;
+
+    return CODEC_PLAIN;
+}
+
+// Codec written to path: zstd for [.zst], gzip otherwise
+static codec_t output_codec(const char *path)
+{
+    size_t length = strlen(path);
+
+    return length >= 4 && strcmp(path + length - 4, ".zst") == 0 ? CODEC_ZSTD : CODEC_GZIP;
+}
+
+/* --------------------------------------- CODECS ---------------------------------------- */
+// The helpers run on a thread of the shell, args is {path, NULL}; they report their own
+// errors, a command whose reader has gone (EPIPE) is not one
+static void helper_error(char **args, const char *message)
+{
+    fprintf(stderr, "tinyshell: %s: %s\n", args[0], message);
+}
+
+static ssize_t read_input(char **args, stream_t *in, unsigned char *buffer, size_t length)
+{
+    ssize_t n = stream_read(in, (char *)buffer, length);
+
+    if (n == -1)
+        helper_error(args, strerror(errno));
+
+    return n;
+}
+
+static int write_output(char **args, stream_t *out, const unsigned char *buffer, size_t length)
+{
+    if (length == 0 || stream_write(out, (const char *)buffer, length) == 0)
+        return 0;
+
+    if (errno != EPIPE)
+        helper_error(args, strerror(errno));
+
+    return -1;
+}
+
+// Open a FIFO left for the helper, see start_compressed()
+static int open_deferred(char **args, stream_t *file, int flags)
+{
+    if (file->fd == -1 && (file->fd = open(args[0], flags | O_CLOEXEC)) == -1)
+    {
+        helper_error(args, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+// Inflate in to out, starting with the n bytes already in buffer. Concatenated members
+// ([cat a.gz b.gz]) are decompressed one after another, as by gzip -d
+static int gzip_decompress(char **args, stream_t *in, stream_t *out, unsigned char *buffer, ssize_t n)
+{
+    unsigned char output[Z_CHUNK];
+    z_stream z = {0};
+    int result = Z_OK, status = 0;
+
+    if (inflateInit2(&z, MAX_WBITS + 16) != Z_OK)
+    {
+        helper_error(args, "inflateInit2() failed");
+        return -1;
+    }
+
+    for (; status == 0 && n > 0; n = read_input(args, in, buffer, Z_CHUNK))
+    {
+        z.next_in = buffer;
+        z.avail_in = n;
+
+        // Until this input is used up without filling the output buffer
+        while (status == 0 && (z.avail_in > 0 || z.avail_out == 0))
+        {
+            if (result == Z_STREAM_END && z.avail_in == 0)
+                break;
+
+            if (result == Z_STREAM_END)
+                inflateReset(&z);
+
+            z.next_out = output;
+            z.avail_out = sizeof(output);
+            result = inflate(&z, Z_NO_FLUSH);
+
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            {
+                helper_error(args, z.msg ? z.msg : "invalid compressed data");
+                status = -1;
+            }
+
+            else if (write_output(args, out, output, sizeof(output) - z.avail_out) == -1)
+            {
+                status = -1;
+            }
+        }
+    }
+
+    if (status == 0 && n == 0 && result != Z_STREAM_END)
+        helper_error(args, "unexpected end of file");
+
+    inflateEnd(&z);
+    return status == 0 && n == 0 && result == Z_STREAM_END ? 0 : -1;
+}
+
+// Deflate in to out in the gzip format, at the default level of gzip
+static int gzip_compress(char **args, stream_t *in, stream_t *out)
+{
+    unsigned char buffer[Z_CHUNK], output[Z_CHUNK];
+    z_stream z = {0};
+    int flush = Z_NO_FLUSH, status = 0;
+
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        helper_error(args, "deflateInit2() failed");
+        return -1;
+    }
+
+    while (status == 0 && flush != Z_FINISH)
+    {
+        ssize_t n = read_input(args, in, buffer, sizeof(buffer));
+
+        if (n == -1)
+        {
+            status = -1;
+            break;
+        }
+
+        // The trailer is written once the command closes its end
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = buffer;
+        z.avail_in = n;
+
+        do
+        {
+            z.next_out = output;
+            z.avail_out = sizeof(output);
+            deflate(&z, flush);
+
+            if (write_output(args, out, output, sizeof(output) - z.avail_out) == -1)
+                status = -1;
+        } while (status == 0 && z.avail_out == 0);
+    }
+
+    deflateEnd(&z);
+    return status;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// Decompress in to out, starting with the n bytes already in buffer. Concatenated frames
+// are decompressed one after another
+static int zstd_decompress(char **args, stream_t *in, stream_t *out, unsigned char *buffer, ssize_t n)
+{
+    unsigned char output[Z_CHUNK];
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    size_t result = 0;
+    int status = 0;
+
+    if (!context)
+    {
+        helper_error(args, "ZSTD_createDCtx() failed");
+        return -1;
+    }
+
+    for (; status == 0 && n > 0; n = read_input(args, in, buffer, Z_CHUNK))
+    {
+        ZSTD_inBuffer input = {buffer, n, 0};
+        ZSTD_outBuffer decoded = {output, sizeof(output), 0};
+
+        // Until this input is used up without filling the output buffer
+        while (status == 0 && (input.pos < input.size || decoded.pos == decoded.size))
+        {
+            decoded.pos = 0;
+            result = ZSTD_decompressStream(context, &decoded, &input);
+
+            if (ZSTD_isError(result))
+            {
+                helper_error(args, ZSTD_getErrorName(result));
+                status = -1;
+            }
+
+            else if (write_output(args, out, output, decoded.pos) == -1)
+            {
+                status = -1;
+            }
+        }
+    }
+
+    // A frame not finished when the input ends
+    if (status == 0 && n == 0 && result != 0)
+        helper_error(args, "unexpected end of file");
+
+    ZSTD_freeDCtx(context);
+    return status == 0 && n == 0 && result == 0 ? 0 : -1;
+}
+
+// Compress in to out as a single zstd frame, at the default level
+static int zstd_compress(char **args, stream_t *in, stream_t *out)
+{
+    unsigned char buffer[Z_CHUNK], output[Z_CHUNK];
+    ZSTD_CCtx *context = ZSTD_createCCtx();
+    ZSTD_EndDirective mode = ZSTD_e_continue;
+    int status = 0;
+
+    if (!context)
+    {
+        helper_error(args, "ZSTD_createCCtx() failed");
+        return -1;
+    }
+
+    while (status == 0 && mode != ZSTD_e_end)
+    {
+        ssize_t n = read_input(args, in, buffer, sizeof(buffer));
+
+        if (n == -1)
+        {
+            status = -1;
+            break;
+        }
+
+        // The frame is ended once the command closes its end
+        mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+
+        ZSTD_inBuffer input = {buffer, n, 0};
+        size_t remaining;
+
+        do
+        {
+            ZSTD_outBuffer encoded = {output, sizeof(output), 0};
+
+            remaining = ZSTD_compressStream2(context, &encoded, &input, mode);
+
+            if (ZSTD_isError(remaining))
+            {
+                helper_error(args, ZSTD_getErrorName(remaining));
+                status = -1;
+            }
+
+            else if (write_output(args, out, output, encoded.pos) == -1)
+            {
+                status = -1;
+            }
+        } while (status == 0 && (mode == ZSTD_e_end ? remaining > 0 : input.pos < input.size));
+    }
+
+    ZSTD_freeCCtx(context);
+    return status;
+}
+#endif
+
+// [<z file] Decode the file onto the command's pipe, by the magic number it starts with
+static int decompress_helper(char **args, stream_t *in, stream_t *out)
+{
+    unsigned char buffer[Z_CHUNK];
+    ssize_t n = 0, got = 1;
+    int status = open_deferred(args, in, O_RDONLY);
+
+    // Enough for the longest magic number, unless the file is shorter
+    while (status == 0 && got > 0 && (size_t)n < sizeof(zstd_magic))
+    {
+        if ((got = read_input(args, in, buffer + n, sizeof(buffer) - n)) == -1)
+            status = -1;
+        else
+            n += got;
+    }
+
+    codec_t codec = input_codec(buffer, n);
+
+    if (status == 0 && !codec_built_in(codec))
+    {
+        char message[64];
+
+        snprintf(message, sizeof(message), "%s support not built in", codec_names[codec]);
+        helper_error(args, message);
+        status = -1;
+    }
+
+    else if (status == 0 && codec == CODEC_PLAIN)
+    {
+        // Passed through as is, like [gzip -dcf]
+        while (status == 0 && n > 0)
+        {
+            status = write_output(args, out, buffer, n);
+            n = read_input(args, in, buffer, sizeof(buffer));
+        }
+
+        status = status == 0 && n == 0 ? 0 : -1;
+    }
+
+#ifdef HAVE_ZLIB
+    else if (status == 0 && codec == CODEC_GZIP)
+        status = gzip_decompress(args, in, out, buffer, n);
+#endif
+
+#ifdef HAVE_ZSTD
+    else if (status == 0 && codec == CODEC_ZSTD)
+        status = zstd_decompress(args, in, out, buffer, n);
+#endif
+
+    free(args);
+    return status;
+}
+
+// [>z file] [>>z file] Encode the command's output into the file
+static int compress_helper(char **args, stream_t *in, stream_t *out)
+{
+    int status = open_deferred(args, out, O_WRONLY);
+
+#ifdef HAVE_ZLIB
+    if (status == 0 && output_codec(args[0]) == CODEC_GZIP)
+        status = gzip_compress(args, in, out);
+#endif
+
+#ifdef HAVE_ZSTD
+    if (status == 0 && output_codec(args[0]) == CODEC_ZSTD)
+        status = zstd_compress(args, in, out);
+#endif
+
+    free(args);
+    return status;
+}
+
+/* ----------------------------------- HELPER THREADS ------------------------------------ */
+static bool is_compressed(const redirect_t *r)
+{
+    return r->type == REDIRECT_INPUT_Z || r->type == REDIRECT_OUTPUT_Z || r->type == REDIRECT_APPEND_Z;
+}
+
+// Whether any redirection is compressed, such a pipeline needs the shell to run its helpers
+bool has_compressed(redirect_t *redirects, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (is_compressed(&redirects[i]))
+            return true;
+    }
+
+    return false;
+}
+
+// {path, NULL} in a single allocation, freed by the helper
+static char **helper_args(const char *path)
+{
+    size_t length = strlen(path) + 1;
+    char **args = malloc(2 * sizeof(*args) + length);
+
+    if (!args)
+        return NULL;
+
+    args[0] = memcpy((char *)(args + 2), path, length);
+    args[1] = NULL;
+
+    return args;
+}
+
+// Start the helpers of the compressed redirections of stage, called in the shell before the
+// stage is forked. The file is opened here, so a missing input fails the stage as [<] does,
+// except for a FIFO: opening it may block until its other end is opened, which the helper
+// waits for instead. Each redirection's source is set to the stage's end of its pipe, above
+// the descriptors the stage redirects. Returns 0, or -1 on error; close_compressed() then
+// closes the ends of the helpers already started
+int start_compressed(job_t *job, redirect_t *redirects, int count, int stage)
+{
+    int highest = STDERR_FILENO;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (redirects[i].stage == stage && redirects[i].fd > highest)
+            highest = redirects[i].fd;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        redirect_t *r = &redirects[i];
+
+        if (r->stage != stage || !is_compressed(r))
+            continue;
+
+        bool input = r->type == REDIRECT_INPUT_Z;
+        int flags = input ? O_RDONLY : O_WRONLY | O_CREAT | (r->type == REDIRECT_APPEND_Z ? O_APPEND : O_TRUNC);
+
+        if (!input && !codec_built_in(output_codec(r->path)))
+        {
+            fprintf(stderr, "tinyshell: %s: %s support not built in\n", r->path, codec_names[output_codec(r->path)]);
+            return -1;
+        }
+
+        struct stat st;
+        bool fifo = stat(r->path, &st) == 0 && S_ISFIFO(st.st_mode);
+        int file = fifo ? -1 : open(r->path, flags | O_CLOEXEC, FILE_MODE),
+            ends[2] = {-1, -1};
+        char **args = NULL;
+
+        if ((!fifo && file == -1) || pipe2(ends, O_CLOEXEC) == -1 || !(args = helper_args(r->path)))
+        {
+            redirect_error(r, errno);
+
+            if (file != -1)
+                close(file);
+
+            if (ends[0] != -1)
+            {
+                close(ends[0]);
+                close(ends[1]);
+            }
+
+            return -1;
+        }
+
+        // The stage's end, kept clear of the descriptors its redirections replace
+        int child_end = input ? ends[0] : ends[1];
+
+        if (child_end <= highest)
+        {
+            int moved = fcntl(child_end, F_DUPFD_CLOEXEC, highest + 1);
+
+            close(child_end);
+            child_end = moved;
+        }
+
+        r->source = child_end;
+
+        stream_t file_stream = {file, NULL, false},
+                 pipe_stream = {input ? ends[1] : ends[0], NULL, false};
+
+        if (child_end == -1 ||
+            inprocess_start(job, -1, input ? decompress_helper : compress_helper, args,
+                            input ? file_stream : pipe_stream, input ? pipe_stream : file_stream) == -1)
+        {
+            if (child_end == -1)
+            {
+                perror("fcntl() failed");
+                stream_close(&file_stream, false);
+                stream_close(&pipe_stream, false);
+            }
+
+            free(args);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Close the shell's copy of the stage's ends, once it has been forked or could not be
+void close_compressed(redirect_t *redirects, int count, int stage)
+{
+    for (int i = 0; i < count; i++)
+    {
+        redirect_t *r = &redirects[i];
+
+        if (r->stage == stage && is_compressed(r) && r->source != -1)
+        {
+            close(r->source);
+            r->source = -1;
+        }
+    }
+}
+
+// Close every descriptor from first upwards, so commands never inherit the shell's own or
+// leaked descriptors (pipe ends held open would stop readers from seeing EOF)
+int close_inherited(int first)
+{
+    if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+        return 0;
+
+    // close_range() unavailable, close up to the descriptor limit
+    long limit = sysconf(_SC_OPEN_MAX);
+
+    for (long fd = first; fd < limit; fd++)
+        close(fd);
+
+    return 0;
 }
@@ -0,0 +1,136 @@
+/* ---------------------------------------- scan.c ---------------------------------------- */
+/* Provides scan_plain(), used by read_word() to skip over the plain characters of a word   */
+/* in bulk, so only spaces, metacharacters, quotes, [$] and [\] go through the per-char     */
+/* path. On x86-64 16 bytes (SSE2) or 32 bytes (AVX2, if the CPU has it) are compared with  */
+/* every special character at once; the kernel is chosen on the first call. Other machines  */
+/* and the last few bytes of the input use the scalar loop, which defines the behaviour.    */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "tinyshell.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+// Characters ending a run of plain characters: spaces and metacharacters end an unquoted
+// word, ["] toggles quoting, [$] may start an expansion and [\] escapes the next character
+// The characters which are also special when quoted come last
+static const char unquoted_specials[] = {' ', '\t', '\n', '|', '>', '<', ';', '&', '"', '$', '\\'};
+static const char quoted_specials[] = {'"', '$', '\\'};
+
+#define COUNT(array) (sizeof(array) / sizeof(*(array)))
+
+/* ---------------------------------------- SCALAR --------------------------------------- */
+static size_t scan_scalar(const char *s, size_t n, bool quoted)
+{
+    const char *specials = quoted ? quoted_specials : unquoted_specials;
+    size_t count = quoted ? COUNT(quoted_specials) : COUNT(unquoted_specials);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t k = 0; k < count; k++)
+        {
+            if (s[i] == specials[k])
+                return i;
+        }
+    }
+
+    return n;
+}
+
+/* ----------------------------------------- SIMD ---------------------------------------- */
+#ifdef SCAN_SIMD
+// Bit i set if s[i] is special, for 16 bytes
+static unsigned special_mask_sse2(const char *s, bool quoted)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)s),
+            hits = _mm_cmpeq_epi8(block, _mm_set1_epi8('"'));
+
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('$')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+
+    if (!quoted)
+    {
+        for (size_t k = 0; k < COUNT(unquoted_specials) - COUNT(quoted_specials); k++)
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(unquoted_specials[k])));
+    }
+
+    return _mm_movemask_epi8(hits);
+}
+
+static size_t scan_sse2(const char *s, size_t n, bool quoted)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        unsigned mask = special_mask_sse2(s + i, quoted);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scan_scalar(s + i, n - i, quoted);
+}
+
+// Bit i set if s[i] is special, for 32 bytes
+__attribute__((target("avx2"))) static unsigned special_mask_avx2(const char *s, bool quoted)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)s),
+            hits = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('"'));
+
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('$')));
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\')));
+
+    if (!quoted)
+    {
+        for (size_t k = 0; k < COUNT(unquoted_specials) - COUNT(quoted_specials); k++)
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(unquoted_specials[k])));
+    }
+
+    return _mm256_movemask_epi8(hits);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *s, size_t n, bool quoted)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        unsigned mask = special_mask_avx2(s + i, quoted);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + scan_sse2(s + i, n - i, quoted);
+}
+#endif
+
+/* --------------------------------------- DISPATCH -------------------------------------- */
+static size_t scan_first(const char *s, size_t n, bool quoted);
+
+static size_t (*scan)(const char *s, size_t n, bool quoted) = scan_first;
+
+// Pick the widest kernel the CPU supports, then scan with it
+static size_t scan_first(const char *s, size_t n, bool quoted)
+{
+#ifdef SCAN_SIMD
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#else
+    scan = scan_scalar;
+#endif
+
+    return scan(s, n, quoted);
+}
+
+// Length of the run of plain characters at the start of s, n if there is no special one
+// quoted: inside ["], where spaces and metacharacters are plain
+size_t scan_plain(const char *s, size_t n, bool quoted)
+{
+    return scan(s, n, quoted);
+}
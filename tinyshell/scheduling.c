@@ -0,0 +1,289 @@
+/* ------------------------------------- scheduling.c ------------------------------------- */
+/* Provides the [sched] prefix, which sets the CPU affinity, nice level, I/O priority and   */
+/* scheduling policy of a pipeline (first command) or a single stage (any later command).   */
+/* Attributes are applied in each child before execvp(), so no taskset/nice/ionice process  */
+/* is needed. With [spread], every stage is pinned to a distinct CPU of its allowed set.    */
+/*                                                                                          */
+/* sched [cpus=LIST] [nice=N] [ioprio=rt|be|idle[:LEVEL]] [policy=other|batch|idle]         */
+/*       [spread] command ...                                                               */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define MAX_NAME 16 // Longer attribute names are unknown anyway
+
+/* --------------------------------------- PARSING --------------------------------------- */
+void init_sched(sched_attr_t *sched)
+{
+    memset(sched->cpus, 0, sizeof(sched->cpus));
+    sched->nice = 0;
+    sched->ioprio = 0;
+    sched->policy = SCHED_OTHER;
+
+    sched->set_cpus =
+        sched->set_nice =
+            sched->set_ioprio =
+                sched->set_policy = false;
+}
+
+// Parse a CPU list such as [0,2-3] into the affinity bitmap, returns -1 if invalid
+static int parse_cpus(const char *value, sched_attr_t *sched)
+{
+    const char *range = value;
+
+    while (1)
+    {
+        char *end;
+        long first = strtol(range, &end, 10),
+             last = first;
+
+        if (end == range)
+            return -1;
+
+        if (*end == '-')
+        {
+            const char *start = end + 1;
+            last = strtol(start, &end, 10);
+
+            if (end == start)
+                return -1;
+        }
+
+        if ((*end != '\0' && *end != ',') || first < 0 || last < first || last >= MAX_CPUS)
+            return -1;
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            sched->cpus[cpu / 8] |= 1 << (cpu % 8);
+        }
+
+        if (*end == '\0')
+            break;
+
+        range = end + 1;
+    }
+
+    sched->set_cpus = true;
+    return 0;
+}
+
+// Parse an I/O priority such as [be:4] or [idle], returns -1 if invalid
+static int parse_ioprio(const char *value, sched_attr_t *sched)
+{
+    const char *colon = strchr(value, ':');
+    size_t length = colon ? (size_t)(colon - value) : strlen(value);
+    long level = 4;
+    int class;
+
+    if (colon)
+    {
+        char *end;
+        level = strtol(colon + 1, &end, 10);
+
+        if (end == colon + 1 || *end != '\0' || level < 0 || level > 7)
+            return -1;
+    }
+
+    if (length == 2 && strncmp(value, "rt", length) == 0)
+        class = 1;
+    else if (length == 2 && strncmp(value, "be", length) == 0)
+        class = 2;
+    else if (length == 4 && strncmp(value, "idle", length) == 0)
+        class = 3, level = 0;
+    else
+        return -1;
+
+    sched->ioprio = (class << IOPRIO_CLASS_SHIFT) | level;
+    sched->set_ioprio = true;
+    return 0;
+}
+
+// Parse [sched name=value ...] at the start of args. The words are left as they are, like
+// [limit]'s, since [bench] and [memo] run the same parsed pipeline again
+// Returns the number of words consumed, or -1 on error
+int parse_sched_prefix(char **args, sched_attr_t *sched, bool *spread)
+{
+    int a = 1;
+
+    for (; args[a] != NULL; a++)
+    {
+        if (strcmp(args[a], "spread") == 0)
+        {
+            *spread = true;
+            continue;
+        }
+
+        char *equals = strchr(args[a], '=');
+
+        if (!equals)
+            break;
+
+        char name[MAX_NAME];
+        char *value = equals + 1;
+        int valid = 0;
+
+        snprintf(name, sizeof(name), "%.*s", (int)(equals - args[a]), args[a]);
+
+        if (strcmp(name, "cpus") == 0)
+        {
+            valid = parse_cpus(value, sched);
+        }
+
+        else if (strcmp(name, "nice") == 0)
+        {
+            char *end;
+            sched->nice = strtol(value, &end, 10);
+            sched->set_nice = true;
+            valid = (end == value || *end != '\0') ? -1 : 0;
+        }
+
+        else if (strcmp(name, "ioprio") == 0)
+        {
+            valid = parse_ioprio(value, sched);
+        }
+
+        else if (strcmp(name, "policy") == 0)
+        {
+            sched->set_policy = true;
+
+            if (strcmp(value, "other") == 0)
+                sched->policy = SCHED_OTHER;
+            else if (strcmp(value, "batch") == 0)
+                sched->policy = SCHED_BATCH;
+            else if (strcmp(value, "idle") == 0)
+                sched->policy = SCHED_IDLE;
+            else
+                valid = -1;
+        }
+
+        else
+        {
+            fprintf(stderr, "sched: %s: unknown attribute\n", name);
+            return -1;
+        }
+
+        if (valid == -1)
+        {
+            fprintf(stderr, "sched: %s: invalid value [%s]\n", name, value);
+            return -1;
+        }
+    }
+
+    if (args[a] == NULL)
+    {
+        fprintf(stderr, "sched: command required\n");
+        return -1;
+    }
+
+    return a;
+}
+
+/* --------------------------------------- APPLYING -------------------------------------- */
+static void to_cpu_set(const sched_attr_t *sched, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (sched->cpus[cpu / 8] & (1 << (cpu % 8)))
+            CPU_SET(cpu, set);
+    }
+}
+
+// Pick the n-th CPU (wrapping around) of the allowed set
+static int nth_cpu(cpu_set_t *set, int n)
+{
+    int count = CPU_COUNT(set);
+
+    if (count == 0)
+        return -1;
+
+    n %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    }
+
+    return -1;
+}
+
+// Apply the pipeline's attributes, overridden by the stage's own, called in the child
+int sched_apply(pipeline_attr_t *attr, int stage)
+{
+    sched_attr_t *global = &attr->sched;
+    sched_attr_t *local = attr->stage_sched ? &attr->stage_sched[stage] : NULL;
+    cpu_set_t set;
+
+    // CPU affinity
+    sched_attr_t *cpus = local && local->set_cpus ? local : global->set_cpus ? global : NULL;
+    bool spread = attr->spread && !(local && local->set_cpus);
+
+    if (cpus)
+    {
+        to_cpu_set(cpus, &set);
+    }
+
+    else if (spread && sched_getaffinity(0, sizeof(set), &set) == -1)
+    {
+        return -1;
+    }
+
+    // Spread: stages without their own CPU list each get a distinct CPU of the allowed set
+    if (spread)
+    {
+        int cpu = nth_cpu(&set, stage);
+
+        if (cpu >= 0)
+        {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    if ((cpus || spread) && sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        return -1;
+    }
+
+    // Scheduling policy (before nice, SCHED_IDLE ignores it)
+    sched_attr_t *policy = local && local->set_policy ? local : global->set_policy ? global : NULL;
+
+    if (policy)
+    {
+        struct sched_param param = {0};
+
+        if (sched_setscheduler(0, policy->policy, &param) == -1)
+            return -1;
+    }
+
+    // Nice level
+    sched_attr_t *nice = local && local->set_nice ? local : global->set_nice ? global : NULL;
+
+    if (nice && setpriority(PRIO_PROCESS, 0, nice->nice) == -1)
+    {
+        return -1;
+    }
+
+    // I/O priority
+    sched_attr_t *ioprio = local && local->set_ioprio ? local : global->set_ioprio ? global : NULL;
+
+    if (ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio->ioprio) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
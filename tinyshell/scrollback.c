@@ -0,0 +1,454 @@
+/* ------------------------------------- scrollback.c ------------------------------------- */
+/* Provides the scrollback cache, enabled with [set -o scrollback[=SIZE]] (default 4M).     */
+/* The STDOUT and STDERR of a foreground pipeline's last stage go through pipes owned by    */
+/* the shell, whose event loop forwards everything to the terminal and keeps a copy in a    */
+/* ring buffer per command. A command keeps at most a quarter of SIZE (its most recent      */
+/* output); SIZE caps all commands together, the oldest being evicted first. [last]         */
+/* replays a command's output without running it again. The last stage writes to a pipe,    */
+/* not the terminal, so commands which check isatty() behave as they do in a pipeline.      */
+/*                                                                                          */
+/* last [n]          last -g PATTERN [n]          last -l                                   */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define DEFAULT_SCROLLBACK (4 * 1024 * 1024) // Bytes kept for all commands together
+#define ENTRY_SHARE 4                        // A command keeps at most 1/ENTRY_SHARE of it
+#define MIN_CAPACITY 4096                    // Initial size of a command's buffer
+#define READ_CHUNK 65536                     // Max bytes forwarded per read()
+#define MAX_COMMAND 256                      // Max length of a command's recorded text
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Captured output of one command, a ring buffer once it reaches the per-command limit
+typedef struct entry_t
+{
+    char *command;
+    char *data;
+    size_t capacity;
+    size_t start;   // Offset of the oldest byte kept
+    size_t length;  // Bytes kept
+    size_t dropped; // Older bytes overwritten once the buffer was full
+    int status;
+    struct entry_t *next; // Next newer command
+} entry_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+bool option_scrollback = false;
+
+static size_t limit = DEFAULT_SCROLLBACK;
+static size_t used = 0; // Bytes allocated by every entry
+
+static entry_t *oldest = NULL,
+               *newest = NULL;
+static int entry_count = 0;
+
+// Command being captured, and the shell's ends of its pipes
+static entry_t *current = NULL;
+static int read_out = -1, read_err = -1;
+static int write_out = -1, write_err = -1;
+
+/* --------------------------------------- ENTRIES --------------------------------------- */
+static void entry_free(entry_t *entry)
+{
+    used -= entry->capacity + strlen(entry->command) + 1;
+
+    free(entry->command);
+    free(entry->data);
+    free(entry);
+}
+
+// Evict the oldest finished command, returns false if there is none
+static bool evict_oldest(void)
+{
+    entry_t *entry = oldest;
+
+    if (!entry || entry == current)
+        return false;
+
+    oldest = entry->next;
+
+    if (newest == entry)
+        newest = NULL;
+
+    entry_count--;
+    entry_free(entry);
+    return true;
+}
+
+// Grow the current command's buffer towards its limit, evicting older commands for room
+static void entry_grow(entry_t *entry, size_t needed)
+{
+    size_t entry_limit = limit / ENTRY_SHARE;
+
+    // The buffer only grows before it first wraps, start is then still 0
+    if (entry->capacity >= entry_limit || entry->start != 0 || entry->length + needed <= entry->capacity)
+        return;
+
+    size_t capacity = entry->capacity ? entry->capacity : MIN_CAPACITY;
+
+    while (capacity < entry->length + needed && capacity < entry_limit)
+        capacity *= 2;
+
+    if (capacity > entry_limit)
+        capacity = entry_limit;
+
+    while (used + (capacity - entry->capacity) > limit && evict_oldest())
+        ;
+
+    if (used + (capacity - entry->capacity) > limit)
+        capacity = limit > used ? entry->capacity + (limit - used) : entry->capacity;
+
+    char *grown = capacity > entry->capacity ? realloc(entry->data, capacity) : NULL;
+
+    if (!grown)
+        return;
+
+    used += capacity - entry->capacity;
+    entry->data = grown;
+    entry->capacity = capacity;
+}
+
+// Append length bytes to the current command, overwriting its oldest output once full
+static void entry_append(entry_t *entry, const char *buffer, size_t length)
+{
+    entry_grow(entry, length);
+
+    size_t capacity = entry->capacity;
+
+    if (capacity == 0)
+    {
+        entry->dropped += length;
+        return;
+    }
+
+    // More than fits: only the tail is kept
+    if (length >= capacity)
+    {
+        entry->dropped += entry->length + length - capacity;
+        memcpy(entry->data, buffer + length - capacity, capacity);
+        entry->start = 0;
+        entry->length = capacity;
+        return;
+    }
+
+    size_t end = (entry->start + entry->length) % capacity,
+           first = length < capacity - end ? length : capacity - end;
+
+    memcpy(entry->data + end, buffer, first);
+    memcpy(entry->data, buffer + first, length - first);
+
+    if (entry->length + length > capacity)
+    {
+        size_t overwritten = entry->length + length - capacity;
+
+        entry->start = (entry->start + overwritten) % capacity;
+        entry->length = capacity;
+        entry->dropped += overwritten;
+    }
+
+    else
+    {
+        entry->length += length;
+    }
+}
+
+// Command text of the pipeline, stages separated by [|]
+static char *command_text(int argc, char **pipeline[])
+{
+    char text[MAX_COMMAND];
+    size_t length = 0;
+
+    text[0] = '\0';
+
+    for (int i = 0; i < argc; i++)
+    {
+        for (char **arg = pipeline[i]; *arg && length < sizeof(text); arg++)
+        {
+            length += snprintf(text + length, sizeof(text) - length, "%s%s", length ? " " : "", *arg);
+        }
+
+        if (i < argc - 1 && length < sizeof(text))
+            length += snprintf(text + length, sizeof(text) - length, " |");
+    }
+
+    return strdup(text);
+}
+
+/* --------------------------------------- CAPTURE --------------------------------------- */
+static int write_all(int fd, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, buffer, length);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+
+        if (written == -1)
+            return -1;
+
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+static void close_reader(int *fd)
+{
+    if (*fd == -1)
+        return;
+
+    supervisor_unwatch(*fd);
+    close(*fd);
+    *fd = -1;
+}
+
+// Forward what the last stage wrote to the terminal, keeping a copy. Called by the event
+// loop when fd is readable, and to drain the pipes once the pipeline has finished
+static void capture_ready(int fd)
+{
+    char buffer[READ_CHUNK];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (n <= 0)
+    {
+        close_reader(fd == read_out ? &read_out : &read_err);
+        return;
+    }
+
+    write_all(fd == read_out ? STDOUT_FILENO : STDERR_FILENO, buffer, n);
+
+    if (current)
+        entry_append(current, buffer, n);
+}
+
+// Create the pipes for the last stage of a foreground pipeline, if scrollback is on
+// capture[0] and capture[1] are set to the ends the stage writes its STDOUT and STDERR to,
+// or -1 if output is not captured
+void scrollback_start(int argc, char **pipeline[], int capture[2])
+{
+    int out[2], err[2];
+
+    capture[0] = capture[1] = -1;
+
+    if (!option_scrollback)
+        return;
+
+    entry_t *entry = calloc(1, sizeof(*entry));
+
+    if (!entry || !(entry->command = command_text(argc, pipeline)))
+    {
+        perror("scrollback: malloc() failed");
+        free(entry);
+        return;
+    }
+
+    if (pipe2(out, O_CLOEXEC) == -1)
+    {
+        perror("scrollback: pipe2() failed");
+        free(entry->command);
+        free(entry);
+        return;
+    }
+
+    if (pipe2(err, O_CLOEXEC) == -1)
+    {
+        perror("scrollback: pipe2() failed");
+        close(out[0]);
+        close(out[1]);
+        free(entry->command);
+        free(entry);
+        return;
+    }
+
+    // Only the shell's ends are non-blocking, the stage's are left as usual
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+    read_out = out[0];
+    read_err = err[0];
+    write_out = capture[0] = out[1];
+    write_err = capture[1] = err[1];
+
+    if (supervisor_watch(read_out, capture_ready) == -1 || supervisor_watch(read_err, capture_ready) == -1)
+    {
+        perror("scrollback: supervisor_watch() failed");
+
+        scrollback_started();
+        close_reader(&read_out);
+        close_reader(&read_err);
+
+        free(entry->command);
+        free(entry);
+        capture[0] = capture[1] = -1;
+        return;
+    }
+
+    used += strlen(entry->command) + 1;
+    current = entry;
+
+    if (newest)
+        newest->next = entry;
+    else
+        oldest = entry;
+
+    newest = entry;
+    entry_count++;
+}
+
+// Close the shell's write ends once every stage has been forked
+void scrollback_started(void)
+{
+    if (write_out != -1)
+        close(write_out);
+
+    if (write_err != -1)
+        close(write_err);
+
+    write_out = write_err = -1;
+}
+
+// Drain and close the pipes once the pipeline has finished. Output written later (by a
+// process left running in the background) is not kept
+void scrollback_finish(int status)
+{
+    scrollback_started();
+
+    while (read_out != -1 || read_err != -1)
+    {
+        size_t before = current ? current->length + current->dropped : 0;
+
+        if (read_out != -1)
+            capture_ready(read_out);
+
+        if (read_err != -1)
+            capture_ready(read_err);
+
+        // Nothing left to read right now
+        if (!current || current->length + current->dropped == before)
+        {
+            close_reader(&read_out);
+            close_reader(&read_err);
+        }
+    }
+
+    if (!current)
+        return;
+
+    current->status = status;
+
+    // Commands which wrote nothing are forgotten, so [last] shows the last output
+    if (current->length == 0 && current->dropped == 0)
+    {
+        entry_t **link = &oldest;
+
+        while (*link != current)
+            link = &(*link)->next;
+
+        *link = NULL;
+        newest = NULL;
+
+        for (entry_t *entry = oldest; entry; entry = entry->next)
+            newest = entry;
+
+        entry_count--;
+        entry_free(current);
+    }
+
+    current = NULL;
+}
+
+/* --------------------------------------- OPTIONS --------------------------------------- */
+// Set the bytes kept for every command together, evicting the oldest to fit
+void scrollback_limit(size_t size)
+{
+    limit = size;
+
+    while (used > limit && evict_oldest())
+        ;
+}
+
+// Bytes kept for every command together
+size_t scrollback_size(void)
+{
+    return limit;
+}
+
+/* --------------------------------------- REPLAY ---------------------------------------- */
+void scrollback_list(void)
+{
+    int n = entry_count;
+
+    for (entry_t *entry = oldest; entry; entry = entry->next, n--)
+    {
+        printf("%4d  %3d  %10zu  %s\n", n, entry->status, entry->length, entry->command);
+    }
+}
+
+// Replay the output of the nth most recent command (1 for the last), only the lines
+// containing pattern if it is not NULL. Returns 0, or -1 if there is no such command
+int scrollback_replay(int n, const char *pattern)
+{
+    if (n < 1 || n > entry_count)
+        return -1;
+
+    entry_t *entry = oldest;
+
+    for (int i = entry_count; i > n; i--)
+    {
+        entry = entry->next;
+    }
+
+    fflush(stdout);
+
+    if (entry->dropped > 0)
+        fprintf(stderr, "last: %zu earlier bytes of [%s] were not kept\n", entry->dropped, entry->command);
+
+    size_t first = entry->capacity - entry->start < entry->length ? entry->capacity - entry->start : entry->length;
+
+    if (!pattern)
+    {
+        write_all(STDOUT_FILENO, entry->data + entry->start, first);
+        write_all(STDOUT_FILENO, entry->data, entry->length - first);
+        return 0;
+    }
+
+    // Lines may wrap around the end of the buffer, so a contiguous copy is searched
+    char *text = malloc(entry->length + 1);
+
+    if (!text)
+    {
+        perror("malloc() failed");
+        return 0;
+    }
+
+    memcpy(text, entry->data + entry->start, first);
+    memcpy(text + first, entry->data, entry->length - first);
+    text[entry->length] = '\0';
+
+    for (char *line = text; line < text + entry->length;)
+    {
+        char *end = memchr(line, '\n', text + entry->length - line);
+        size_t length = end ? (size_t)(end - line) + 1 : (size_t)(text + entry->length - line);
+
+        if (memmem(line, length, pattern, strlen(pattern)))
+            write_all(STDOUT_FILENO, line, length);
+
+        line += length;
+    }
+
+    free(text);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* ------------------------------------ substitution.c ------------------------------------ */
+/* Provides process substitution, [<(command)] and [>(command)] arguments. The inner        */
+/* command line runs in a forked subshell, connected to the outer command by a pipe, and    */
+/* the argument is replaced by [/dev/fd/N], N being the outer command's end of the pipe.    */
+/* Subshells start before the outer pipeline's stages and run concurrently with them; they  */
+/* are helper processes of the outer pipeline's job, so the event loop reaps them. The pipe */
+/* is kept above every descriptor its command redirects, so [N>file] never replaces it.     */
+/* A substitution is an argument only, not a redirection target: [cmd > >(inner)] and       */
+/* [cmd < <(inner)] are syntax errors, [cmd | inner] and [inner | cmd] do the same.         */
+/*                                                                                          */
+/* diff <(sort a) <(sort b)          tar c dir | tee >(sha256sum > sum) > dir.tar           */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "tinyshell.h"
+
+/* --------------------------------------- STARTING -------------------------------------- */
+// Fork a subshell for each substitution and replace its argument with the pipe's path
+// Returns 0, or -1 on error (substitutions already started are left in the job)
+int start_substitutions(job_t *job, substitution_t *substitutions, int count, redirect_t *redirects, int redirect_count)
+{
+    // Buffered output would otherwise be written again by each subshell
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < count; i++)
+    {
+        substitution_t *s = &substitutions[i];
+        int fd[2];
+
+        if (pipe2(fd, O_CLOEXEC) == -1)
+        {
+            perror("pipe2() failed");
+            return -1;
+        }
+
+        // [<(command)] the subshell writes, [>(command)] the subshell reads
+        int inner = s->output ? fd[0] : fd[1],
+            outer = s->output ? fd[1] : fd[0];
+
+        // The path names the descriptor in the stage, so no redirection of it may take it
+        int highest = STDERR_FILENO;
+
+        for (int j = 0; j < redirect_count; j++)
+        {
+            if (redirects[j].stage == s->stage && redirects[j].fd > highest)
+                highest = redirects[j].fd;
+        }
+
+        if (outer <= highest)
+        {
+            int moved = fcntl(outer, F_DUPFD_CLOEXEC, highest + 1);
+
+            if (moved == -1)
+            {
+                perror("fcntl() failed");
+                close(inner);
+                close(outer);
+                return -1;
+            }
+
+            close(outer);
+            outer = moved;
+        }
+
+        uint64_t forked = trace_clock();
+        pid_t pid = fork();
+
+        if (pid == -1)
+        {
+            perror("fork() failed");
+            close(inner);
+            close(outer);
+            return -1;
+        }
+
+        /* CHILD PROCESS */
+        if (pid == 0)
+        {
+            if (dup2(inner, s->output ? STDIN_FILENO : STDOUT_FILENO) == -1)
+            {
+                perror("dup2() failed");
+                _exit(EXIT_FAILURE);
+            }
+
+            // The parent's event loop and other pipes are not inherited by the subshell
+            close_inherited(STDERR_FILENO + 1);
+
+            if (supervisor_subshell() == -1)
+                _exit(EXIT_FAILURE);
+
+            // Output kept by the subshell would be lost with it
+            option_scrollback = false;
+
+            execute_final_line(s->command, strlen(s->command));
+            exit(last_status);
+        }
+
+        /* PARENT PROCESS */
+        trace_record(forked, TRACE_FORK, pid, -1, 0, s->command);
+        close(inner);
+
+        s->fd = outer;
+        snprintf(s->path, sizeof(s->path), "/dev/fd/%d", outer);
+        *s->arg = s->path;
+
+        if (job_add(job, -1, pid) == -1)
+        {
+            perror("job_add() failed");
+        }
+    }
+
+    return 0;
+}
+
+/* --------------------------------------- CHILDREN -------------------------------------- */
+// Let the stage inherit its ends of the pipes, called in the child before execvp()
+// *max_fd is raised to the highest descriptor kept. Returns 0, or -1 on error
+int keep_substitutions(substitution_t *substitutions, int count, int stage, int *max_fd)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (substitutions[i].stage != stage || substitutions[i].fd == -1)
+            continue;
+
+        if (fcntl(substitutions[i].fd, F_SETFD, 0) == -1)
+            return -1;
+
+        if (substitutions[i].fd > *max_fd)
+            *max_fd = substitutions[i].fd;
+    }
+
+    return 0;
+}
+
+// Close the shell's ends of the pipes once every stage has been forked
+void close_substitutions(substitution_t *substitutions, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (substitutions[i].fd != -1)
+        {
+            close(substitutions[i].fd);
+            substitutions[i].fd = -1;
+        }
+    }
+}
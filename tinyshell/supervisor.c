@@ -0,0 +1,602 @@
+/* ------------------------------------- supervisor.c ------------------------------------- */
+/* Provides the shell's event loop, which owns the lifecycle of every child process. Each   */
+/* child is watched through a pidfd registered with epoll, whose event data points straight */
+/* at the child's record, so an exit is handled without scanning other children. SIGCHLD,   */
+/* SIGINT and SIGWINCH are received through a signalfd, and the terminal is watched while   */
+/* the shell waits for input, so background jobs are reaped even at the prompt.             */
+/* Children are grouped into jobs (one per pipeline); foreground jobs are waited on with    */
+/* supervisor_wait(), background jobs are reported by supervisor_notify() when done.        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define MAX_EVENTS 64     // Max number of events handled per epoll_wait()
+#define CHILD_BUCKETS 4096 // Number of buckets in the pid -> child hash table
+#define MAX_WATCHES 4      // Max number of descriptors watched with supervisor_watch()
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Single supervised child process
+typedef struct child_t
+{
+    pid_t pid;
+    int pidfd; // -1 if pidfd_open() is unavailable, the child is then found through SIGCHLD
+    job_t *job; // NULL once the child stopped, its job no longer waits for it
+    int stage;  // -1 for a helper process, such as a process substitution
+
+    bool reaped;
+    struct child_t *next_bucket; // Hash table chain
+    struct child_t *next_list;   // Deferred free list
+} child_t;
+
+// Descriptor read by the shell itself while it waits, such as captured output
+typedef struct
+{
+    int fd; // -1 for a free slot
+    void (*ready)(int fd);
+} watch_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+int terminal_columns = 80;
+int terminal_rows = 24;
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static bool interactive = false;
+static sigset_t supervised_signals;
+static sigset_t original_mask;
+
+// Tokens identifying the non-child epoll sources
+static int signal_token, input_token;
+
+static child_t *buckets[CHILD_BUCKETS];
+static child_t *reaped_children = NULL; // Freed once the current batch of events is handled
+
+static job_t *background_jobs = NULL;
+static job_t *foreground_job = NULL;
+static int next_job_id = 1;
+
+static watch_t watches[MAX_WATCHES] = {{-1, NULL}, {-1, NULL}, {-1, NULL}, {-1, NULL}};
+
+static bool interrupted = false;
+static bool input_ready = false;
+
+/* -------------------------------------- UTILITIES -------------------------------------- */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void update_terminal_size(void)
+{
+    struct winsize size;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+    {
+        terminal_columns = size.ws_col;
+        terminal_rows = size.ws_row;
+    }
+}
+
+// Convert the waitpid() status of a child which exited into a shell exit status (128 + n
+// for signal n). Stopped children are handled by child_stopped()
+int decode_status(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+
+    return EXIT_FAILURE;
+}
+
+/* ------------------------------------ INITIALISATION ----------------------------------- */
+// Create the epoll instance and signalfd, SIGINT is only taken over in interactive shells
+int supervisor_init(bool is_interactive)
+{
+    interactive = is_interactive;
+
+    sigemptyset(&supervised_signals);
+    sigaddset(&supervised_signals, SIGCHLD);
+    sigaddset(&supervised_signals, SIGWINCH);
+
+    if (interactive)
+        sigaddset(&supervised_signals, SIGINT);
+
+    if (sigprocmask(SIG_BLOCK, &supervised_signals, &original_mask) == -1)
+    {
+        perror("sigprocmask() failed");
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    signal_fd = signalfd(-1, &supervised_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (epoll_fd == -1 || signal_fd == -1)
+    {
+        perror("supervisor_init() failed");
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &signal_token};
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1)
+    {
+        perror("epoll_ctl() failed");
+        return -1;
+    }
+
+    update_terminal_size();
+    return 0;
+}
+
+// Restore the signal mask inherited by the shell, called in a child before execvp()
+void supervisor_child_reset(void)
+{
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+}
+
+// Start a fresh, non-interactive event loop in a forked subshell. The epoll instance is
+// shared with the parent across fork(), so it is replaced, and the parent's children and
+// jobs are forgotten (their records are left to the subshell's exit)
+int supervisor_subshell(void)
+{
+    sigprocmask(SIG_SETMASK, &original_mask, NULL);
+
+    close(epoll_fd);
+    close(signal_fd);
+
+    memset(buckets, 0, sizeof(buckets));
+    reaped_children = NULL;
+
+    for (int i = 0; i < MAX_WATCHES; i++)
+        watches[i].fd = -1;
+
+    background_jobs = foreground_job = NULL;
+
+    return supervisor_init(false);
+}
+
+/* ---------------------------------------- JOBS ----------------------------------------- */
+job_t *job_create(int count, bool background)
+{
+    job_t *job = calloc(1, sizeof(*job));
+
+    if (!job)
+        return NULL;
+
+    job->pids = calloc(count, sizeof(*job->pids));
+    job->status = calloc(count, sizeof(*job->status));
+
+    if (!job->pids || !job->status)
+    {
+        free(job->pids);
+        free(job->status);
+        free(job);
+        return NULL;
+    }
+
+    job->background = background;
+
+    if (background)
+    {
+        job->id = next_job_id++;
+        job->next = background_jobs;
+        background_jobs = job;
+    }
+    else
+    {
+        foreground_job = job;
+    }
+
+    return job;
+}
+
+void job_free(job_t *job)
+{
+    if (foreground_job == job)
+        foreground_job = NULL;
+
+    if (job->attr)
+    {
+        limits_report(job->attr);
+        free(job->attr);
+    }
+
+    free(job->pids);
+    free(job->status);
+    free(job);
+}
+
+// Register pid as the given stage of job, or as a helper process of the job if stage is -1
+// (the job runs until its helpers have exited too, but their status is not recorded)
+int job_add(job_t *job, int stage, pid_t pid)
+{
+    child_t *child = calloc(1, sizeof(*child));
+
+    if (!child)
+        return -1;
+
+    child->pid = pid;
+    child->job = job;
+    child->stage = stage;
+    child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    if (stage >= 0)
+    {
+        job->pids[stage] = pid;
+        job->count = stage + 1 > job->count ? stage + 1 : job->count;
+    }
+
+    job->running++;
+
+    // Hash table entry, used when the child is found through SIGCHLD
+    child->next_bucket = buckets[pid % CHILD_BUCKETS];
+    buckets[pid % CHILD_BUCKETS] = child;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = child};
+
+    if (child->pidfd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, child->pidfd, &event) == -1)
+    {
+        // Found through SIGCHLD instead
+        if (child->pidfd != -1)
+            close(child->pidfd);
+
+        child->pidfd = -1;
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------- REAPING -------------------------------------- */
+static void unlink_child(child_t *child)
+{
+    child_t **link = &buckets[child->pid % CHILD_BUCKETS];
+
+    while (*link && *link != child)
+        link = &(*link)->next_bucket;
+
+    if (*link)
+        *link = child->next_bucket;
+}
+
+static child_t *find_child(pid_t pid)
+{
+    child_t *child = buckets[pid % CHILD_BUCKETS];
+
+    while (child && child->pid != pid)
+        child = child->next_bucket;
+
+    return child;
+}
+
+// A stopped child has not exited: its job stops waiting for it and its stage reads 128 + n
+// for stop signal n, as $? does in other shells. The shell has no [fg] to resume it, so it
+// is reported and left stopped, still watched, and reaped whenever it does exit
+static void child_stopped(child_t *child, int status)
+{
+    if (!child->job)
+        return;
+
+    if (child->stage >= 0)
+        child->job->status[child->stage] = 128 + WSTOPSIG(status);
+
+    trace_record(trace_clock(), TRACE_STOP, child->pid, child->stage, 128 + WSTOPSIG(status), NULL);
+    fprintf(stderr, "[%d] Stopped (%d)\n", child->pid, 128 + WSTOPSIG(status));
+
+    child->job->running--;
+    child->job = NULL;
+}
+
+// Record the status of a child which exited and stop watching it
+static void child_exited(child_t *child, int status)
+{
+    if (child->reaped)
+        return;
+
+    child->reaped = true;
+
+    // The job of a child which stopped earlier has already stopped waiting for it
+    if (child->job)
+    {
+        if (child->stage >= 0)
+            child->job->status[child->stage] = decode_status(status);
+
+        child->job->running--;
+    }
+
+    trace_record(trace_clock(), TRACE_EXIT, child->pid, child->stage, decode_status(status), NULL);
+
+    unlink_child(child);
+
+    if (child->pidfd != -1)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+    }
+
+    // Other events of the current batch may still point at the child
+    child->next_list = reaped_children;
+    reaped_children = child;
+}
+
+// Record a status returned by wait4() for child
+static void child_waited(child_t *child, int status, struct rusage *usage)
+{
+    // A stopped child has not used its resources yet
+    if (WIFSTOPPED(status))
+    {
+        child_stopped(child, status);
+        return;
+    }
+
+    if (child->job)
+    {
+        timeradd(&child->job->usage.ru_utime, &usage->ru_utime, &child->job->usage.ru_utime);
+        timeradd(&child->job->usage.ru_stime, &usage->ru_stime, &child->job->usage.ru_stime);
+    }
+
+    child_exited(child, status);
+}
+
+// pidfd event: the child has exited
+static void reap_child(child_t *child)
+{
+    int status;
+    struct rusage usage;
+
+    if (!child->reaped && wait4(child->pid, &status, WNOHANG, &usage) > 0)
+        child_waited(child, status, &usage);
+}
+
+// SIGCHLD: children without a pidfd, and stopped foreground stages (pidfds only report exits)
+// Each child wait4() returns is found in the hash table, so no child is polled in turn
+static void reap_signalled(void)
+{
+    int status;
+    struct rusage usage;
+    pid_t pid;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0)
+    {
+        child_t *child = find_child(pid);
+
+        // A background job runs on while one of its stages is stopped
+        if (!child || (WIFSTOPPED(status) && child->job != foreground_job))
+            continue;
+
+        child_waited(child, status, &usage);
+    }
+}
+
+static void read_signals(void)
+{
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        switch (info.ssi_signo)
+        {
+        case SIGCHLD:
+            reap_signalled();
+            break;
+
+        case SIGINT:
+            interrupted = true;
+            break;
+
+        case SIGWINCH:
+            update_terminal_size();
+            break;
+        }
+    }
+}
+
+/* -------------------------------------- EVENT LOOP ------------------------------------- */
+// Wait up to timeout_ms (-1 for no limit) and handle all ready events
+static int dispatch(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+    if (ready == -1)
+    {
+        if (errno == EINTR)
+            return 0;
+
+        perror("epoll_wait() failed");
+        return -1;
+    }
+
+    for (int i = 0; i < ready; i++)
+    {
+        void *source = events[i].data.ptr;
+
+        if (source == &signal_token)
+            read_signals();
+
+        else if (source == &input_token)
+            input_ready = true;
+
+        else if (source >= (void *)watches && source < (void *)(watches + MAX_WATCHES))
+        {
+            watch_t *watch = source;
+
+            // An earlier handler in the batch may have removed it
+            if (watch->fd != -1)
+                watch->ready(watch->fd);
+        }
+
+        else
+            reap_child(source);
+    }
+
+    while (reaped_children)
+    {
+        child_t *next = reaped_children->next_list;
+        free(reaped_children);
+        reaped_children = next;
+    }
+
+    return 0;
+}
+
+// Call ready(fd) whenever fd is readable while the event loop runs
+// Returns 0, or -1 if fd cannot be watched
+int supervisor_watch(int fd, void (*ready)(int fd))
+{
+    for (int i = 0; i < MAX_WATCHES; i++)
+    {
+        if (watches[i].fd != -1)
+            continue;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &watches[i]};
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            return -1;
+
+        watches[i] = (watch_t){fd, ready};
+        return 0;
+    }
+
+    return -1;
+}
+
+// Stop watching fd, before it is closed
+void supervisor_unwatch(int fd)
+{
+    for (int i = 0; i < MAX_WATCHES; i++)
+    {
+        if (watches[i].fd == fd)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            watches[i].fd = -1;
+        }
+    }
+}
+
+// Run the event loop until job has finished or timeout seconds pass (negative for no limit)
+// Returns 0 when the job finished, 1 if the timeout passed first, or -1 on error
+int supervisor_wait(job_t *job, double timeout)
+{
+    double deadline = now() + timeout;
+
+    // A SIGINT received at the prompt is not meant for this job
+    read_signals();
+    interrupted = false;
+
+    while (job->running > 0)
+    {
+        int timeout_ms = -1;
+
+        if (timeout >= 0)
+        {
+            double remaining = deadline - now();
+
+            if (remaining <= 0)
+                return 1;
+
+            timeout_ms = (int)(remaining * 1000) + 1;
+        }
+
+        if (dispatch(timeout_ms) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Run the event loop until fd is readable
+// Returns 0 when input is ready, or 1 if the user interrupted the prompt with SIGINT
+int supervisor_wait_input(int fd)
+{
+    if (!interactive || epoll_fd == -1)
+        return 0;
+
+    fflush(stdout);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &input_token};
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        return 0;
+
+    input_ready = interrupted = false;
+
+    while (!input_ready && !interrupted)
+    {
+        if (dispatch(-1) == -1)
+            break;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    return interrupted && !input_ready;
+}
+
+// Whether any background job has not been reported yet
+bool supervisor_jobs_pending(void)
+{
+    return background_jobs != NULL;
+}
+
+// Report and release background jobs which have finished
+void supervisor_notify(void)
+{
+    job_t **link = &background_jobs;
+
+    if (epoll_fd != -1)
+        dispatch(0);
+
+    while (*link)
+    {
+        job_t *job = *link;
+
+        if (job->running == 0)
+        {
+            fprintf(stderr, "[%d] Done (%d)\n", job->id, job->status[job->count - 1]);
+            *link = job->next;
+            job_free(job);
+        }
+        else
+        {
+            link = &job->next;
+        }
+    }
+}
+
+// Wait for every background job, returns the status of the last one to be waited on
+int supervisor_wait_all(void)
+{
+    int status = EXIT_SUCCESS;
+
+    while (background_jobs)
+    {
+        job_t *job = background_jobs;
+
+        if (supervisor_wait(job, -1) == -1)
+            return EXIT_FAILURE;
+
+        status = job->status[job->count - 1];
+        background_jobs = job->next;
+        job_free(job);
+    }
+
+    return status;
+}
@@ -0,0 +1,99 @@
+/* -------------------------------------- timeout.c  -------------------------------------- */
+/* Provides the [timeout] prefix. The stages of a timed pipeline run in their own process   */
+/* group and are waited on by the event loop in supervisor.c (pidfds with epoll), so no     */
+/* extra process is needed per command. When the deadline passes, SIGTERM is sent to the    */
+/* whole process group, followed by SIGKILL once the grace period has also passed.          */
+/*                                                                                          */
+/* timeout [-k GRACE] DURATION command ...      (DURATION: 10, 1.5s, 250ms, 2m, 1h)         */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define DEFAULT_GRACE 5.0 // Seconds between SIGTERM and SIGKILL
+
+/* --------------------------------------- PARSING --------------------------------------- */
+// Parse a duration in seconds with an optional ms/s/m/h suffix, returns -1 if invalid
+static double parse_duration(const char *value)
+{
+    char *end;
+    double seconds = strtod(value, &end);
+
+    if (end == value || seconds < 0)
+        return -1;
+
+    if (strcmp(end, "ms") == 0)
+        seconds /= 1000;
+    else if (strcmp(end, "m") == 0)
+        seconds *= 60;
+    else if (strcmp(end, "h") == 0)
+        seconds *= 3600;
+    else if (strcmp(end, "s") != 0 && *end != '\0')
+        return -1;
+
+    return seconds;
+}
+
+// Parse [timeout [-k GRACE] DURATION] at the start of args
+// Returns the number of words consumed, or -1 on error
+int parse_timeout_prefix(char **args, pipeline_attr_t *attr)
+{
+    int a = 1;
+
+    attr->grace = DEFAULT_GRACE;
+
+    if (args[a] && strcmp(args[a], "-k") == 0)
+    {
+        if (!args[a + 1] || (attr->grace = parse_duration(args[a + 1])) < 0)
+        {
+            fprintf(stderr, "timeout: invalid grace period [%s]\n", args[a + 1] ? args[a + 1] : "");
+            return -1;
+        }
+
+        a += 2;
+    }
+
+    if (!args[a] || (attr->timeout = parse_duration(args[a])) <= 0)
+    {
+        fprintf(stderr, "timeout: invalid duration [%s]\n", args[a] ? args[a] : "");
+        return -1;
+    }
+
+    if (!args[++a])
+    {
+        fprintf(stderr, "timeout: command required\n");
+        return -1;
+    }
+
+    return a;
+}
+
+/* --------------------------------------- WAITING --------------------------------------- */
+// Wait until every stage of job has exited, signalling process group pgid once the deadline
+// passes. Returns 1 if the pipeline timed out, 0 if it finished in time, or -1 on error
+int wait_deadline(job_t *job, pid_t pgid, pipeline_attr_t *attr)
+{
+    int waited = supervisor_wait(job, attr->timeout);
+
+    if (waited != 1)
+        return waited;
+
+    fprintf(stderr, "timeout: pipeline timed out after %gs\n", attr->timeout);
+
+    // SIGTERM at the deadline, SIGKILL after the grace period
+    if (kill(-pgid, SIGTERM) == -1 && errno != ESRCH)
+        perror("kill() failed");
+
+    if (supervisor_wait(job, attr->grace) == 1 && kill(-pgid, SIGKILL) == -1 && errno != ESRCH)
+        perror("kill() failed");
+
+    if (supervisor_wait(job, -1) == -1)
+        return -1;
+
+    return 1;
+}
@@ -2,6 +2,15 @@
 /* Provides the read_and_exec() function which tokenises user input and serves as the main  */
 /* command execution driver. The main() function, continually looping, prompting the user   */
 /* and executing read_and_exec() for input and execution is in this file.                   */
+/* A command sequence is a list of pipelines separated by [;], [&&] or [||]. Each pipeline  */
+/* is read and executed before the next one is tokenised, so [$?] always refers to the      */
+/* pipeline which ran last, and pipelines skipped by [&&]/[||] are never forked. A pipeline */
+/* terminated by [&] runs in the background, and one separated by [|*] fans out (fanout.c). */
+/* Lines, words and pipelines have no fixed size limit; the input line is tokenised in a    */
+/* single pass. The first word of each command is replaced by its alias, if it has one.     */
+/* [tinyshell -c command] runs a single command line after the rc file (rc.c).              */
+/* The last command of [-c], of a script read from a file, or of a process substitution is  */
+/* exec'd in place of the shell when nothing is left for the shell to do (tail exec).       */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,764 +18,1094 @@
 #include "tinyshell.h"
 
 /* -------------------------------------- CONSTANTS -------------------------------------- */
-#define MAX_IN 256           // Max number of characters to read using fgets()
-#define MAX_PIPELINES 8      // Max number of pipelines ([ls | grep c]; [echo h])
-#define MAX_COMMANDS 8       // Max number of commands ([ls] | [grep c])
-#define MAX_ARGS 8           // Max number of arguments per command ([grep] [c])
-#define MAX_TOKEN_LENGTH 256 // Max token length per argument ([g][r][e][p])
-#define MAX_FILE 64          // Max in/out file name length
+#define MIN_WORDS 256       // Initial capacity of a pipeline's word characters
+#define MIN_ARGS 16         // Initial capacity of a pipeline's argument list
+#define MIN_COMMANDS 4      // Initial capacity of a pipeline's command list
+#define MIN_REDIRECTS 4     // Initial capacity of a pipeline's redirection list
+#define MIN_SUBSTITUTIONS 2 // Initial capacity of a pipeline's process substitution list
+#define MAX_FD_DIGITS 6     // Max length of N in [N>file]
+#define MAX_STATUS_INDEX 16 // Max length of n in [${PIPESTATUS[n]}]
 
 /* ------------------------------------- ANSI COLORS ------------------------------------- */
 #define ANSI_PROMPT "\e[0;33m"
 #define ANSI_CWD "\e[0;35m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Operator terminating a pipeline in a command sequence
+typedef enum
+{
+    SEQUENCE_END,  // End of input
+    SEQUENCE_NEXT, // [;]
+    SEQUENCE_AND,  // [&&]
+    SEQUENCE_OR,   // [||]
+    SEQUENCE_ASYNC // [&]
+} sequence_op_t;
+
+// Redirection being tokenised, the file path is stored as an offset since words grow
+typedef struct
+{
+    redirect_t redirect;
+    size_t path;
+} pending_redirect_t;
+
+// Process substitution being tokenised, the command is stored as a word of the pipeline
 typedef struct
 {
+    int stage;
+    size_t command; // Offset in words of the command line
+    bool output;    // [>(command)]
+    int arg;        // Index in args of the argument it replaces
+} pending_substitution_t;
 
+// Pipeline currently being tokenised, words are stored as offsets since the buffers grow
+typedef struct
+{
+    char *words; // Characters of every word, each NUL terminated
+    size_t words_length,
+        words_capacity;
+
+    size_t *args; // Offset in words of each argument, commands are stored back to back
+    int arg_total,
+        args_capacity;
+
+    int *first_arg;    // Index in args of the first argument of each command
+    int command_count; // Number of commands in the pipeline ([ls] | [grep c])
+    int commands_capacity;
+    pipe_link_t *links; // Connection of each command to the previous one ([|] or [|*])
+    int links_capacity;
+    int arg_count; // Number of arguments in the last command ([grep] [c])
+
+    pending_redirect_t *redirects; // Redirections of every command, in order
+    int redirect_count,
+        redirects_capacity;
+
+    pending_substitution_t *substitutions; // Process substitutions of every command
+    int substitution_count,
+        substitutions_capacity;
 } pipeline_t;
 
-// Read user input and execute it using functions in execute.c
-int read_and_exec()
+/* ------------------------------------- STORAGE ---------------------------------------- */
+// Grow array to hold at least needed elements of the given size
+static void *grow(void *array, int *capacity, size_t size, int needed, int minimum)
 {
-    // Pipeline allocation
-    char ***pipeline = malloc(MAX_PIPELINES * MAX_COMMANDS * sizeof(*pipeline));
+    if (needed <= *capacity)
+        return array;
 
-    for (int i = 0; i < (MAX_PIPELINES * MAX_COMMANDS); i++)
-    {
-        pipeline[i] = malloc(MAX_ARGS * sizeof(*pipeline[i]));
+    int grown_capacity = *capacity ? *capacity : minimum;
 
-        for (int j = 0; j < MAX_ARGS; j++)
-        {
-            pipeline[i][j] = malloc(MAX_TOKEN_LENGTH * sizeof(*pipeline[i][j]));
-        }
-    }
+    while (grown_capacity < needed)
+        grown_capacity *= 2;
 
-    // User input
-    char in_buf[MAX_IN];
+    void *grown = realloc(array, grown_capacity * size);
 
-    if (!fgets(in_buf, MAX_IN, stdin))
+    if (!grown)
     {
-        fprintf(stderr, "fgets() failed.\n");
-        exit(EXIT_FAILURE);
+        perror("realloc() failed");
+        return NULL;
     }
 
-    in_buf[strlen(in_buf) - 1] = '\0';
+    *capacity = grown_capacity;
+    return grown;
+}
 
-    int current_commands = 1; // Keep track of number of commands in the current pipeline
+static int put_char(pipeline_t *p, char c)
+{
+    if (p->words_length + 1 >= p->words_capacity)
+    {
+        size_t capacity = p->words_capacity ? p->words_capacity * 2 : MIN_WORDS;
+        char *grown = realloc(p->words, capacity);
 
-    int i = 0, // Command index
-        j = 0, // Argument index
-        k = 0; // Character index
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
 
-    // Boolean modes corresponding to metacharacters
-    bool status_pipe = false,
-         status_output_redirect = false,
-         status_input_redirect = false,
-         status_quote = false;
+        p->words = grown;
+        p->words_capacity = capacity;
+    }
 
-    // Meta-modes used when executing
-    bool do_output_redirect = false,
-         do_append_out = false,
-         do_input_redirect = false;
+    p->words[p->words_length++] = c;
+    return 0;
+}
 
-    // Input/output redirection file paths
-    char *file_out = malloc(MAX_FILE * sizeof(char));
-    int out_i = 0;
+// Append length characters to the current word
+static int put_chars(pipeline_t *p, const char *s, size_t length)
+{
+    while (p->words_length + length >= p->words_capacity)
+    {
+        size_t capacity = p->words_capacity ? p->words_capacity * 2 : MIN_WORDS;
+        char *grown = realloc(p->words, capacity);
 
-    char *file_in = malloc(MAX_FILE * sizeof(char));
-    int in_i = 0;
+        if (!grown)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
 
-    // Input/output redirection file paths encountered
-    bool out_waiting = false,
-         in_waiting = false;
+        p->words = grown;
+        p->words_capacity = capacity;
+    }
 
-    bool char_encountered = false;
+    memcpy(p->words + p->words_length, s, length);
+    p->words_length += length;
+    return 0;
+}
 
-    bool do_pipe = true;
-    bool wait_for_semicolon = false;
+static int add_arg(pipeline_t *p, size_t word)
+{
+    size_t *args = grow(p->args, &p->args_capacity, sizeof(*p->args), p->arg_total + 1, MIN_ARGS);
 
-    bool execute = true;
+    if (!args)
+        return -1;
 
-    // Traverse user input
-    for (int c = 0; c < strlen(in_buf); c++)
-    {
-        // Skip redundant pipes + command sequences/pipelines/commands/arguments which are too long
-        if (wait_for_semicolon)
-        {
-            if (c < strlen(in_buf) - 1 && in_buf[c] == ';')
-            {
-                wait_for_semicolon = false;
+    p->args = args;
+    p->args[p->arg_total++] = word;
+    p->arg_count++;
 
-                if (execute)
-                {
-                    if (i + 1 >= MAX_COMMANDS)
-                    {
-                        fprintf(stderr, "Too many pipelines passed to pipeline sequence\n");
-                        return EXIT_FAILURE;
-                    }
+    return 0;
+}
 
-                    if (c == strlen(in_buf) - 1)
-                    {
-                        continue;
-                    }
+static int add_command(pipeline_t *p, pipe_link_t link)
+{
+    int *first_arg = grow(p->first_arg, &p->commands_capacity, sizeof(*p->first_arg), p->command_count + 1, MIN_COMMANDS);
 
-                    pipeline[i][j][k] = '\0';
-                    pipeline[i][j + 1] = NULL;
+    if (!first_arg)
+        return -1;
 
-                    if (do_output_redirect)
-                        file_out[strlen(file_out)] = '\0';
-                    else
-                        file_out = NULL;
+    p->first_arg = first_arg;
 
-                    if (do_input_redirect)
-                        file_in[strlen(file_in)] = '\0';
-                    else
-                        file_in = NULL;
+    pipe_link_t *links = grow(p->links, &p->links_capacity, sizeof(*p->links), p->command_count + 1, MIN_COMMANDS);
 
-                    if (current_commands == 1 && execute_builtin(**(pipeline + i), *(pipeline + i), false) == 0)
-                    {
-                        free(file_out);
-                        file_out = malloc(MAX_FILE * sizeof(char));
+    if (!links)
+        return -1;
 
-                        free(file_in);
-                        file_in = malloc(MAX_FILE * sizeof(char));
+    p->links = links;
+    p->links[p->command_count] = link;
+    p->first_arg[p->command_count++] = p->arg_total;
+    p->arg_count = 0;
 
-                        do_append_out =
-                            do_input_redirect =
-                                do_output_redirect = false;
+    return 0;
+}
 
-                        status_input_redirect =
-                            status_output_redirect =
-                                status_pipe =
-                                    status_quote = false;
+static int add_redirect(pipeline_t *p, redirect_t redirect, size_t path)
+{
+    pending_redirect_t *redirects = grow(p->redirects, &p->redirects_capacity, sizeof(*p->redirects), p->redirect_count + 1, MIN_REDIRECTS);
 
-                        i++;
-                        j = 0;
-                        k = 0;
+    if (!redirects)
+        return -1;
 
-                        current_commands = 1;
+    p->redirects = redirects;
+    p->redirects[p->redirect_count].redirect = redirect;
+    p->redirects[p->redirect_count++].path = path;
 
-                        out_i = 0;
-                        in_i = 0;
+    return 0;
+}
 
-                        do_pipe = true;
+static int add_substitution(pipeline_t *p, pending_substitution_t substitution)
+{
+    pending_substitution_t *substitutions = grow(p->substitutions, &p->substitutions_capacity, sizeof(*p->substitutions), p->substitution_count + 1, MIN_SUBSTITUTIONS);
 
-                        out_waiting = false;
-                        in_waiting = false;
+    if (!substitutions)
+        return -1;
 
-                        continue;
-                    }
+    p->substitutions = substitutions;
+    p->substitutions[p->substitution_count++] = substitution;
 
-                    else if (execute_pipeline(current_commands, pipeline + (i - (current_commands - 1)), false, do_input_redirect ? file_in : NULL, do_output_redirect ? file_out : NULL, do_append_out) == 1)
-                    {
-                        fprintf(stderr, "Exeuction failed\n");
-                        return EXIT_FAILURE;
-                    }
+    return 0;
+}
 
-                    else
-                    {
-                        free(file_out);
-                        file_out = malloc(MAX_FILE * sizeof(char));
+static int reset_pipeline(pipeline_t *p)
+{
+    p->words_length = 0;
+    p->arg_total = 0;
+    p->command_count = 0;
+    p->redirect_count = 0;
+    p->substitution_count = 0;
 
-                        free(file_in);
-                        file_in = malloc(MAX_FILE * sizeof(char));
+    return add_command(p, LINK_PIPE);
+}
 
-                        do_append_out =
-                            do_input_redirect =
-                                do_output_redirect = false;
+static void free_pipeline(pipeline_t *p)
+{
+    free(p->words);
+    free(p->args);
+    free(p->first_arg);
+    free(p->links);
+    free(p->redirects);
+    free(p->substitutions);
+}
 
-                        status_input_redirect =
-                            status_output_redirect =
-                                status_pipe =
-                                    status_quote = false;
+/* ----------------------------------- TOKENISATION ------------------------------------- */
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
 
-                        i++;
-                        j = 0;
-                        k = 0;
+// Characters which end an unquoted word
+static bool is_meta(const char *s)
+{
+    return *s == '|' || *s == '>' || *s == '<' || *s == ';' || *s == '&';
+}
 
-                        current_commands = 1;
+// Append the decimal value of n to the current word
+static int put_number(pipeline_t *p, int n)
+{
+    char number[16];
+    int digits = snprintf(number, sizeof(number), "%d", n);
 
-                        out_i = 0;
-                        in_i = 0;
+    for (int d = 0; d < digits; d++)
+    {
+        if (put_char(p, number[d]) == -1)
+            return -1;
+    }
+
+    return 0;
+}
 
-                        do_pipe = true;
+// Expand [$?] or [${PIPESTATUS[n]}] / [${PIPESTATUS[@]}] at in_buf[*c] into the current word
+// Returns 1 if an expansion was consumed, 0 if in_buf[*c] does not start one, or -1 on error
+static int expand_status(pipeline_t *p, const char *in_buf, size_t n, size_t *c)
+{
+    const char *prefix = "${PIPESTATUS[";
+    size_t prefix_length = strlen(prefix);
 
-                        out_waiting = false;
-                        in_waiting = false;
+    if (*c + 1 < n && in_buf[*c + 1] == '?')
+    {
+        *c += 2;
+        return put_number(p, last_status) == -1 ? -1 : 1;
+    }
 
-                        continue;
-                    }
-                }
-                else
-                {
-                    execute = true;
+    if (n - *c < prefix_length || strncmp(in_buf + *c, prefix, prefix_length) != 0)
+    {
+        return 0;
+    }
 
-                    free(file_out);
-                    file_out = malloc(MAX_FILE * sizeof(char));
+    // Closing [\]}] is searched for within a bounded window, keeping tokenisation linear
+    size_t index = *c + prefix_length;
+    size_t window = n - index < MAX_STATUS_INDEX ? n - index : MAX_STATUS_INDEX;
+    const char *close = NULL;
 
-                    free(file_in);
-                    file_in = malloc(MAX_FILE * sizeof(char));
+    for (size_t i = 0; i + 1 < window; i++)
+    {
+        if (in_buf[index + i] == ']' && in_buf[index + i + 1] == '}')
+        {
+            close = in_buf + index + i;
+            break;
+        }
+    }
 
-                    do_append_out =
-                        do_input_redirect =
-                            do_output_redirect = false;
+    if (!close)
+    {
+        return 0;
+    }
 
-                    status_input_redirect =
-                        status_output_redirect =
-                            status_pipe =
-                                status_quote = false;
+    if ((in_buf[index] == '@' || in_buf[index] == '*') && close == in_buf + index + 1)
+    {
+        for (int s = 0; s < pipe_status_count; s++)
+        {
+            if ((s > 0 && put_char(p, ' ') == -1) || put_number(p, pipe_status[s]) == -1)
+                return -1;
+        }
+    }
+    else
+    {
+        char *end;
+        long status_index = strtol(in_buf + index, &end, 10);
 
-                    i++;
-                    j = 0;
-                    k = 0;
+        if (end != close || end == in_buf + index)
+        {
+            return 0;
+        }
 
-                    current_commands = 1;
+        if (status_index >= 0 && status_index < pipe_status_count && put_number(p, pipe_status[status_index]) == -1)
+        {
+            return -1;
+        }
+    }
 
-                    out_i = 0;
-                    in_i = 0;
+    *c = close - in_buf + 2;
+    return 1;
+}
 
-                    do_pipe = true;
+// Read a word starting at in_buf[*c] into the pipeline's words, stopping at an unquoted space
+// or metacharacter. *word is set to the word's offset in words
+// Returns 0 on success, 1 on mismatched quotes, or -1 if memory could not be allocated
+static int read_word(pipeline_t *p, const char *in_buf, size_t n, size_t *c, size_t *word)
+{
+    bool status_quote = false;
 
-                    out_waiting = false;
-                    in_waiting = false;
+    *word = p->words_length;
 
-                    continue;
-                }
-            }
-            else if (c == strlen(in_buf) - 1)
-            {
-                if (in_buf[c] == ' ')
-                {
-                    if (execute_pipeline(current_commands, pipeline + (i - (current_commands - 1)), false, do_input_redirect ? file_in : NULL, do_output_redirect ? file_out : NULL, do_append_out) == 1)
-                    {
-                        fprintf(stderr, "Exeuction failed\n");
-                        return EXIT_FAILURE;
-                    }
-
-                    return EXIT_SUCCESS;
-                }
-                else
-                {
-                    return EXIT_FAILURE;
-                }
-            }
-            else
-            {
-                continue;
-            }
-        }
+    while (*c < n)
+    {
+        // Plain characters are copied in bulk, found by the SIMD kernel in scan.c
+        size_t plain = scan_plain(in_buf + *c, n - *c, status_quote);
 
-        /* CHECK SYNTAX */
-        // First and last argument cannot be metacharacters
-        if (c == 0 || c == strlen(in_buf) - 2)
+        if (plain > 0)
         {
-            if (in_buf[c] == '>' && in_buf[c + 1] == '>')
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", ">>");
-                return EXIT_FAILURE;
-            }
-        }
+            if (put_chars(p, in_buf + *c, plain) == -1)
+                return -1;
 
-        if (c == 0 || c == strlen(in_buf) - 1)
-        {
-            if (in_buf[c] == '|' ||
-                in_buf[c] == '>' ||
-                in_buf[c] == '<' ||
-                (c == 0 && in_buf[c] == ';'))
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%c]\n", in_buf[c]);
-                return EXIT_FAILURE;
-            }
+            *c += plain;
+            continue;
         }
 
-        // Disallow adjacent metacharacters
-        if (!status_quote && c < strlen(in_buf) - 2 && in_buf[c] == '>' && in_buf[c + 1] == '>' &&
-            (in_buf[c + 2] == '|' ||
-             in_buf[c + 2] == '>' ||
-             in_buf[c + 2] == '<' ||
-             in_buf[c + 2] == ';'))
+        char ch = in_buf[*c];
+
+        // Unquoted space or metacharacter ends the word
+        if (!status_quote && (is_space(ch) || is_meta(in_buf + *c)))
         {
-            fprintf(stderr, "Syntax error near unexpected token [%c]\n", in_buf[c]);
-            return EXIT_FAILURE;
+            break;
         }
 
-        if (!status_quote && !(in_buf[c] == '>' && in_buf[c + 1] == '>') &&
-            (in_buf[c] == '|' ||
-             in_buf[c] == '>' ||
-             in_buf[c] == '<' ||
-             in_buf[c] == ';') &&
-            (in_buf[c + 1] == '|' ||
-             in_buf[c + 1] == '>' ||
-             in_buf[c + 1] == '<' ||
-             in_buf[c + 1] == ';'))
+        // ["] Literal interpretation
+        if (ch == '"')
         {
-            fprintf(stderr, "Syntax error near unexpected token [%c]\n", in_buf[c]);
-            return EXIT_FAILURE;
+            status_quote = !status_quote;
+            (*c)++;
+            continue;
         }
 
-        /* CHECK IF METACHARACTER */
-        // [|] Pipe
-        if (!status_quote && in_buf[c] == '|')
+        // [$?] Exit status expansion
+        if (ch == '$')
         {
-            if (!char_encountered)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", "|");
-                return EXIT_FAILURE;
-            }
-            if (do_pipe)
-            {
-                if (current_commands >= MAX_COMMANDS)
-                {
-                    fprintf(stderr, "Too many commands passed in pipeline [%s ... | %s ... | ... ]\n", pipeline[i - (current_commands - 1)][0], pipeline[i - (current_commands - 1) + 1][0]);
-                    wait_for_semicolon = true;
-                    execute = false;
-                    continue;
-                }
-
-                if (status_output_redirect)
-                {
-                    if (out_waiting) // First out file character which is not a space
-                    {
-                        continue;
-                    }
-                    else // First space encountered while reading out file
-                    {
-                        file_out[out_i] = '\0';
-                        status_output_redirect = false;
-                        out_waiting = false;
-                        // wait_for_semicolon = true;
-                        continue;
-                    }
-                }
-
-                if (status_input_redirect)
-                {
-                    if (in_waiting)
-                    {
-                        continue;
-                    }
-                    else
-                    {
-                        file_in[in_i] = '\0';
-                        status_input_redirect = false;
-                        in_waiting = false;
-                        continue;
-                    }
-                }
-
-                status_pipe = true;
-                status_output_redirect = false;
-                status_input_redirect = false;
-
-                pipeline[i][j][k] = '\0';
-                pipeline[i][j + 1] = NULL;
-
-                i++;
-                j = 0;
-                k = 0;
-
-                current_commands++;
+            int expanded = expand_status(p, in_buf, n, c);
 
+            if (expanded == -1)
+                return -1;
+
+            if (expanded == 1)
                 continue;
-            }
-            else
-            {
-                continue;
-            }
         }
 
-        // [>>] Append out (overrides output redirect)
-        else if (!status_quote && in_buf[c] == '>' && in_buf[c + 1] == '>')
+        // [\] Strip metacharacter meaning of following character
+        if (ch == '\\' && *c + 1 < n)
         {
-            if (!char_encountered)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", ">>");
-                return EXIT_FAILURE;
-            }
+            ch = in_buf[++(*c)];
+        }
 
-            if (do_output_redirect)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", ">>");
-                return EXIT_FAILURE;
-            }
+        if (put_char(p, ch) == -1)
+            return -1;
+
+        (*c)++;
+    }
+
+    if (put_char(p, '\0') == -1)
+        return -1;
 
-            status_pipe = false;
-            status_output_redirect = true;
+    return status_quote ? 1 : 0;
+}
 
-            do_output_redirect = true;
-            do_append_out = true;
+// Replace the command word at offset word with the words of its alias, if it has one
+// Aliases are expanded once, an alias naming another alias is not expanded again
+// Returns 0 on success, or -1 if memory could not be allocated
+static int expand_alias(pipeline_t *p, size_t word)
+{
+    const char *value = alias_lookup(p->words + word);
 
-            out_waiting = true;
+    if (!value)
+        return add_arg(p, word);
 
-            pipeline[i][j][k] = '\0';
-            pipeline[i][j + 1] = NULL;
+    p->words_length = word;
 
-            c++;
-            continue;
-        }
+    while (*value)
+    {
+        while (is_space(*value))
+            value++;
 
-        // [>] Output redirect
-        else if (!status_quote && in_buf[c] == '>')
+        if (!*value)
+            break;
+
+        size_t offset = p->words_length;
+
+        for (; *value && !is_space(*value); value++)
         {
-            if (!char_encountered)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", ">");
-                return EXIT_FAILURE;
-            }
+            if (put_char(p, *value) == -1)
+                return -1;
+        }
 
-            if (do_output_redirect)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%c]\n", in_buf[c]);
-                return EXIT_FAILURE;
-            }
+        if (put_char(p, '\0') == -1 || add_arg(p, offset) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-            status_pipe = false;
-            status_output_redirect = true;
+static int syntax_error(const char *token);
 
-            do_output_redirect = true;
+// Read a redirection starting at in_buf[*c] into the last command of the pipeline:
+// [<] [>] [>>] [<>] [>&] [<&], optionally preceded by a file descriptor number ([2>]),
+// or [&>] / [&>>] for both STDOUT and STDERR. [<z] [>z] [>>z] (de)compress the file
+// Returns 1 if a redirection was read, 0 if in_buf[*c] does not start one, or -1 on error
+static int read_redirect(pipeline_t *p, const char *in_buf, size_t n, size_t *c)
+{
+    size_t i = *c;
+    int fd = -1;
+    bool both = false;
 
-            out_waiting = true;
+    // [&>] STDOUT and STDERR
+    if (in_buf[i] == '&' && in_buf[i + 1] == '>')
+    {
+        both = true;
+        i++;
+    }
 
-            pipeline[i][j][k] = '\0';
-            pipeline[i][j + 1] = NULL;
+    // [N>] File descriptor number, only when the operator follows the digits directly
+    else if (is_digit(in_buf[i]))
+    {
+        size_t digits = 0;
 
-            continue;
+        for (fd = 0; i < n && is_digit(in_buf[i]) && digits < MAX_FD_DIGITS; i++, digits++)
+            fd = fd * 10 + in_buf[i] - '0';
+
+        if (in_buf[i] != '<' && in_buf[i] != '>')
+            return 0;
+    }
+
+    else if (in_buf[i] != '<' && in_buf[i] != '>')
+    {
+        return 0;
+    }
+
+    redirect_t redirect = {.stage = p->command_count - 1, .path = NULL, .source = -1};
+    const char *token;
+
+    if (in_buf[i] == '<')
+    {
+        redirect.fd = fd == -1 ? STDIN_FILENO : fd;
+
+        if (in_buf[i + 1] == '>')
+            redirect.type = REDIRECT_READ_WRITE, token = "<>";
+        else if (in_buf[i + 1] == '&')
+            redirect.type = REDIRECT_DUPLICATE, token = "<&";
+        else
+            redirect.type = REDIRECT_INPUT, token = "<";
+    }
+    else
+    {
+        redirect.fd = fd == -1 ? STDOUT_FILENO : fd;
+
+        if (in_buf[i + 1] == '>')
+            redirect.type = REDIRECT_APPEND, token = both ? "&>>" : ">>";
+        else if (in_buf[i + 1] == '&' && !both)
+            redirect.type = REDIRECT_DUPLICATE, token = ">&";
+        else
+            redirect.type = REDIRECT_OUTPUT, token = both ? "&>" : ">";
+    }
+
+    // [<z] [>z] [>>z] Compressed, only when a space follows: [<zfile] reads zfile
+    size_t end = i + strlen(token) - both;
+
+    if (end + 1 < n && in_buf[end] == 'z' && (in_buf[end + 1] == ' ' || in_buf[end + 1] == '\t') &&
+        (redirect.type == REDIRECT_INPUT || redirect.type == REDIRECT_OUTPUT || redirect.type == REDIRECT_APPEND))
+    {
+        static const redirect_type_t compressed[] = {
+            [REDIRECT_INPUT] = REDIRECT_INPUT_Z, [REDIRECT_OUTPUT] = REDIRECT_OUTPUT_Z, [REDIRECT_APPEND] = REDIRECT_APPEND_Z};
+
+        redirect.type = compressed[redirect.type];
+        end++;
+    }
+
+    if (p->arg_count == 0 || (both && in_buf[i] == '<'))
+    {
+        syntax_error(token);
+        return -1;
+    }
+
+    *c = end;
+
+    while (*c < n && is_space(in_buf[*c]))
+        (*c)++;
+
+    if (*c >= n || is_meta(in_buf + *c))
+    {
+        syntax_error(*c >= n ? "newline" : token);
+        return -1;
+    }
+
+    size_t path;
+    int word = read_word(p, in_buf, n, c, &path);
+
+    if (word != 0)
+    {
+        if (word == 1)
+            fprintf(stderr, "Syntax error: mismatched quotes\n");
+
+        return -1;
+    }
+
+    // [N>&M] Duplicate M, [N>&-] Close N
+    if (redirect.type == REDIRECT_DUPLICATE)
+    {
+        char *target = p->words + path;
+        char *end;
+        long source = strtol(target, &end, 10);
+
+        if (strcmp(target, "-") == 0)
+        {
+            redirect.type = REDIRECT_CLOSE;
         }
 
-        // [<] Input redirect
-        else if (!status_quote && in_buf[c] == '<')
+        else if (end == target || *end != '\0' || !is_digit(*target) || end - target > MAX_FD_DIGITS)
         {
-            if (!char_encountered)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", "<");
-                return EXIT_FAILURE;
-            }
+            syntax_error(target);
+            return -1;
+        }
 
-            if (do_input_redirect)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%c]\n", in_buf[c]);
-                return EXIT_FAILURE;
-            }
+        redirect.source = source;
+    }
 
-            status_pipe = false;
-            status_output_redirect = false;
-            status_input_redirect = true;
+    if (add_redirect(p, redirect, path) == -1)
+        return -1;
 
-            do_input_redirect = true;
+    // [&>file] is [>file 2>&1]
+    if (both)
+    {
+        redirect_t error = {.stage = redirect.stage, .fd = STDERR_FILENO, .type = REDIRECT_DUPLICATE, .path = NULL, .source = STDOUT_FILENO};
 
-            in_waiting = true;
+        if (add_redirect(p, error, 0) == -1)
+            return -1;
+    }
 
-            pipeline[i][j][k] = '\0';
-            pipeline[i][j + 1] = NULL;
+    return 1;
+}
 
-            continue;
-        }
+// Read a process substitution [<(command)] or [>(command)] starting at in_buf[*c] as an
+// argument of the last command. The command is kept as written, up to the matching [)]
+// Returns 1 if a substitution was read, 0 if in_buf[*c] does not start one, or -1 on error
+static int read_substitution(pipeline_t *p, const char *in_buf, size_t n, size_t *c)
+{
+    if ((in_buf[*c] != '<' && in_buf[*c] != '>') || in_buf[*c + 1] != '(')
+        return 0;
+
+    bool status_quote = false;
+    int depth = 1;
+    size_t end = *c + 2;
+
+    for (; end < n; end++)
+    {
+        if (in_buf[end] == '\\' && end + 1 < n)
+            end++;
+        else if (in_buf[end] == '"')
+            status_quote = !status_quote;
+        else if (!status_quote && in_buf[end] == '(')
+            depth++;
+        else if (!status_quote && in_buf[end] == ')' && --depth == 0)
+            break;
+    }
 
-        // [ ] New argument
-        else if (!status_quote && in_buf[c] == ' ')
+    if (end >= n)
+    {
+        fprintf(stderr, "Syntax error: mismatched parentheses\n");
+        last_status = EXIT_SYNTAX_ERROR;
+        return -1;
+    }
+
+    pending_substitution_t substitution = {
+        .stage = p->command_count - 1,
+        .command = p->words_length,
+        .output = in_buf[*c] == '>',
+        .arg = p->arg_total};
+
+    for (size_t i = *c + 2; i < end; i++)
+    {
+        if (put_char(p, in_buf[i]) == -1)
+            return -1;
+    }
+
+    // The command word stands in for the argument until the substitution is started
+    if (put_char(p, '\0') == -1 || add_arg(p, substitution.command) == -1 || add_substitution(p, substitution) == -1)
+        return -1;
+
+    *c = end + 1;
+    return 1;
+}
+
+/* ------------------------------------- EXECUTION -------------------------------------- */
+static int syntax_error(const char *token)
+{
+    fprintf(stderr, "Syntax error near unexpected token [%s]\n", token);
+    last_status = EXIT_SYNTAX_ERROR;
+    return EXIT_FAILURE;
+}
+
+static const char *op_token(sequence_op_t op)
+{
+    switch (op)
+    {
+    case SEQUENCE_NEXT:
+        return ";";
+    case SEQUENCE_AND:
+        return "&&";
+    case SEQUENCE_OR:
+        return "||";
+    case SEQUENCE_ASYNC:
+        return "&";
+    default:
+        return "newline";
+    }
+}
+
+// Parse prefix commands, which set attributes of the whole pipeline when given on the first
+// command ([limit memory=1G sort | uniq]), and of a single stage otherwise
+// Returns 1 if any prefix was found, 0 if none, or -1 if a prefix is invalid
+static int parse_prefixes(char ***commands, int count, pipeline_attr_t *attr)
+{
+    int prefixed = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        init_sched(&attr->stage_sched[i]);
+
+        while (true)
         {
-            if (j + 1 >= MAX_ARGS)
+            int consumed = 0;
+
+            if (i == 0 && strcmp(commands[i][0], "limit") == 0)
             {
-                fprintf(stderr, "Too many arguments passed to command [%s] in pipeline %d\n", pipeline[i - (current_commands - 1)][0], i - (current_commands - 1) + 1);
-                wait_for_semicolon = true;
-                execute = false;
-                continue;
+                consumed = parse_limit_prefix(commands[i], attr);
             }
 
-            if (status_output_redirect)
+            else if (i == 0 && strcmp(commands[i][0], "timeout") == 0)
             {
-                if (out_waiting) // First out file character which is not a space
-                {
-                    continue;
-                }
-                else // First space encountered while reading out file
-                {
-                    file_out[out_i] = '\0';
-                    status_output_redirect = false;
-                    out_waiting = false;
-                    // wait_for_semicolon = true;
-                    continue;
-                }
+                consumed = parse_timeout_prefix(commands[i], attr);
             }
 
-            if (status_input_redirect)
+            else if (i == 0 && strcmp(commands[i][0], "bench") == 0)
             {
-                if (in_waiting)
-                {
-                    continue;
-                }
-                else
-                {
-                    file_in[in_i] = '\0';
-                    status_input_redirect = false;
-                    in_waiting = false;
-                    continue;
-                }
+                consumed = parse_bench_prefix(commands[i], attr);
             }
 
-            if (c == strlen(in_buf) - 1)
+            else if (i == 0 && strcmp(commands[i][0], "memo") == 0)
             {
-                return EXIT_SUCCESS;
+                consumed = parse_memo_prefix(commands[i], attr);
             }
 
-            if ((c == 0 || c == strlen(in_buf) - 1) ||
-                (j == 0 && k == 0) ||
-                in_buf[c + 1] == ' ' ||
-                in_buf[c + 1] == '|' ||
-                in_buf[c + 1] == '>' ||
-                in_buf[c + 1] == '<' ||
-                in_buf[c + 1] == ';' ||
-                in_buf[c - 1] == '|' ||
-                in_buf[c - 1] == '>' ||
-                in_buf[c - 1] == '<' ||
-                in_buf[c - 1] == ';')
+            else if (strcmp(commands[i][0], "sched") == 0)
             {
-                continue;
+                consumed = parse_sched_prefix(commands[i], i == 0 ? &attr->sched : &attr->stage_sched[i], &attr->spread);
             }
 
-            pipeline[i][j][k] = '\0';
+            if (consumed == 0)
+                break;
 
-            j++;
-            k = 0;
+            if (consumed == -1)
+                return -1;
 
-            continue;
+            commands[i] += consumed;
+            prefixed = 1;
         }
+    }
 
-        // ["] Literal interpretation
-        else if (in_buf[c] == '"')
-        {
-            if (status_quote)
-            {
-                status_quote = false;
-                continue;
-            }
+    return prefixed;
+}
 
-            status_quote = true;
+// Execute args as a builtin in the shell itself, recording it on the shell's trace track
+// Returns the builtin's exit status, or BUILTIN_NOT_FOUND
+static int run_builtin(char **args)
+{
+    uint64_t started = trace_clock();
+    int status = execute_builtin(args[0], args, false);
 
-            continue;
-        }
+    if (status != BUILTIN_NOT_FOUND && started)
+    {
+        trace_begin_pipeline();
+        trace_record(started, TRACE_BUILTIN, trace_shell(), 0, 0, args[0]);
+        trace_record(trace_clock(), TRACE_BUILTIN_END, trace_shell(), 0, status, args[0]);
+    }
 
-        // [\] Strip metacharacter meaning of following character
-        else if (in_buf[c] == '\\')
+    return status;
+}
+
+// Execute a fully tokenised pipeline and update $?
+// tail: the pipeline is the last thing the shell runs, it may replace the shell
+// Returns the pipeline's exit status, or -1 if the shell failed to execute it
+static int run_pipeline(pipeline_t *p, bool async, bool tail)
+{
+    int status;
+    pipeline_attr_t attr;
+
+    // NULL terminated argument vector of each command, pointing into words
+    char **argv = malloc((p->arg_total + p->command_count) * sizeof(*argv));
+    char ***commands = malloc(p->command_count * sizeof(*commands));
+    sched_attr_t *stage_sched = malloc(p->command_count * sizeof(*stage_sched));
+    redirect_t *redirects = malloc((p->redirect_count + 1) * sizeof(*redirects));
+    substitution_t *substitutions = malloc((p->substitution_count + 1) * sizeof(*substitutions));
+
+    if (!argv || !commands || !stage_sched || !redirects || !substitutions)
+    {
+        perror("malloc() failed");
+
+        free(argv);
+        free(commands);
+        free(stage_sched);
+        free(redirects);
+        free(substitutions);
+
+        last_status = EXIT_FAILURE;
+        return -1;
+    }
+
+    for (int i = 0, a = 0; i < p->command_count; i++)
+    {
+        int end = i + 1 < p->command_count ? p->first_arg[i + 1] : p->arg_total;
+
+        commands[i] = argv + a;
+
+        for (int j = p->first_arg[i]; j < end; j++)
         {
-            if (k + 1 >= MAX_TOKEN_LENGTH)
-            {
-                fprintf(stderr, "Too many characters passed to argument [%c%c%c%c%c...] in pipeline %d\n",
-                        pipeline[i][j][0], pipeline[i][j][1], pipeline[i][j][2], pipeline[i][j][3], pipeline[i][j][4], i + 1);
-                wait_for_semicolon = true;
-                execute = false;
-                continue;
-            }
-            pipeline[i][j][k++] = in_buf[c + 1];
-            c++;
-            continue;
+            argv[a++] = p->words + p->args[j];
         }
 
-        // [;] Additional pipeline
-        else if (!status_quote && in_buf[c] == ';')
-        {
-            if (!char_encountered)
-            {
-                fprintf(stderr, "Syntax error near unexpected token [%s]\n", ";");
-                return EXIT_FAILURE;
-            }
+        argv[a++] = NULL;
+    }
 
-            wait_for_semicolon = false;
+    for (int i = 0; i < p->redirect_count; i++)
+    {
+        redirects[i] = p->redirects[i].redirect;
 
-            if (i + 1 >= MAX_COMMANDS)
-            {
-                fprintf(stderr, "Too many pipelines passed to pipeline sequence\n");
-                return EXIT_FAILURE;
-            }
+        if (redirects[i].type != REDIRECT_DUPLICATE && redirects[i].type != REDIRECT_CLOSE)
+            redirects[i].path = p->words + p->redirects[i].path;
+    }
 
-            if (c == strlen(in_buf) - 1)
-            {
-                continue;
-            }
+    // argv holds a NULL after each command, so argument j of stage i is argv[j + i]
+    for (int i = 0; i < p->substitution_count; i++)
+    {
+        pending_substitution_t *pending = &p->substitutions[i];
 
-            pipeline[i][j][k] = '\0';
-            pipeline[i][j + 1] = NULL;
+        substitutions[i].stage = pending->stage;
+        substitutions[i].command = p->words + pending->command;
+        substitutions[i].output = pending->output;
+        substitutions[i].arg = &argv[pending->arg + pending->stage];
+        substitutions[i].fd = -1;
+    }
 
-            if (do_output_redirect)
-                file_out[strlen(file_out)] = '\0';
-            else
-                file_out = NULL;
+    init_attr(&attr);
+    attr.stage_sched = stage_sched;
 
-            if (do_input_redirect)
-                file_in[strlen(file_in)] = '\0';
-            else
-                file_in = NULL;
+    int prefixed = parse_prefixes(commands, p->command_count, &attr);
 
-            if (current_commands == 1 && execute_builtin(**(pipeline + i), *(pipeline + i), false) == 0)
-            {
-                free(file_out);
-                file_out = malloc(MAX_FILE * sizeof(char));
+    if (prefixed == -1)
+    {
+        int syntax = EXIT_SYNTAX_ERROR;
 
-                free(file_in);
-                file_in = malloc(MAX_FILE * sizeof(char));
+        record_status(&syntax, 1);
+        status = last_status = EXIT_SYNTAX_ERROR;
+    }
 
-                do_append_out =
-                    do_input_redirect =
-                        do_output_redirect = false;
+    // Attempt to execute command as builtin
+    else if (!prefixed && !async && p->command_count == 1 && p->substitution_count == 0 && (status = run_builtin(commands[0])) != BUILTIN_NOT_FOUND)
+    {
+        record_status(&status, 1);
+        last_status = status;
+    }
 
-                status_input_redirect =
-                    status_output_redirect =
-                        status_pipe =
-                            status_quote = false;
+    // Run the pipeline repeatedly and report its timings, in bench.c
+    else if (attr.bench_runs > 0 && !async)
+    {
+        status = bench_pipeline(p->command_count, commands, p->links, redirects, p->redirect_count,
+                                substitutions, p->substitution_count, &attr);
 
-                i++;
-                j = 0;
-                k = 0;
+        last_status = status == -1 ? EXIT_FAILURE : status;
+    }
 
-                current_commands = 1;
+    // Replay the pipeline's output from the cache, or run it and cache it, in memo.c
+    else if (attr.memo && !async)
+    {
+        status = memo_pipeline(p->command_count, commands, p->links, redirects, p->redirect_count,
+                               substitutions, p->substitution_count, &attr);
 
-                out_i = 0;
-                in_i = 0;
+        last_status = status == -1 ? EXIT_FAILURE : status;
+    }
 
-                do_pipe = true;
+    // Tail exec: nothing is left to run, report or flush once the command exits, so it
+    // replaces the shell instead of being forked and waited on. Compressed redirections
+    // need the shell, which runs their helper threads
+    else if (tail && !prefixed && !async && p->command_count == 1 && p->substitution_count == 0 &&
+             !option_trace && !option_scrollback && !supervisor_jobs_pending() && !has_compressed(redirects, p->redirect_count))
+    {
+        execute_in_place(commands[0], redirects, p->redirect_count);
+    }
 
-                out_waiting = false;
-                in_waiting = false;
+    // Execute command using execvp() in execute.c
+    else
+    {
+        if (attr.bench_runs > 0)
+            fprintf(stderr, "bench: ignored for background pipelines\n");
 
-                continue;
-            }
+        if (attr.memo)
+            fprintf(stderr, "memo: ignored for background pipelines\n");
 
-            else if (execute_pipeline(current_commands, pipeline + (i - (current_commands - 1)), false, do_input_redirect ? file_in : NULL, do_output_redirect ? file_out : NULL, do_append_out) == 1)
-            {
-                fprintf(stderr, "Exeuction failed\n");
-                return EXIT_FAILURE;
-            }
+        status = execute_pipeline(p->command_count, commands, p->links, async, redirects, p->redirect_count,
+                                  substitutions, p->substitution_count, &attr);
 
-            else
-            {
-                free(file_out);
-                file_out = malloc(MAX_FILE * sizeof(char));
+        last_status = status == -1 ? EXIT_FAILURE : status;
+    }
 
-                free(file_in);
-                file_in = malloc(MAX_FILE * sizeof(char));
+    free(argv);
+    free(commands);
+    free(stage_sched);
+    free(redirects);
+    free(substitutions);
 
-                do_append_out =
-                    do_input_redirect =
-                        do_output_redirect = false;
+    trace_flush();
 
-                status_input_redirect =
-                    status_output_redirect =
-                        status_pipe =
-                            status_quote = false;
+    return status;
+}
 
-                i++;
-                j = 0;
-                k = 0;
+// Read user input and execute it using functions in execute.c
+int read_and_exec()
+{
+    // User input
+    char *in_buf;
+    size_t n;
 
-                current_commands = 1;
+    int read = read_line(STDIN_FILENO, &in_buf, &n);
 
-                out_i = 0;
-                in_i = 0;
+    // [^C] at the prompt
+    if (read == 1)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    if (read == -1)
+    {
+        exit(last_status);
+    }
 
-                do_pipe = true;
+    // The last line of a script read from a file is run as the shell's last command
+    if (input_exhausted(STDIN_FILENO))
+        return execute_final_line(in_buf, n);
 
-                out_waiting = false;
-                in_waiting = false;
+    return execute_line(in_buf, n);
+}
 
-                continue;
+// Tokenise and execute a command sequence
+// final: the shell exits after it, so its last pipeline may be exec'd in place of the shell
+static int execute_sequence(const char *in_buf, size_t n, bool final)
+{
+    int result = EXIT_SUCCESS;
+
+    // Pipeline allocation
+    pipeline_t p = {0};
+
+    if (reset_pipeline(&p) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    bool run = true; // Cleared when the pipeline is skipped by [&&] or [||]
+    sequence_op_t previous = SEQUENCE_NEXT;
+
+    size_t c = 0;
+
+    // Traverse user input
+    while (true)
+    {
+        while (c < n && is_space(in_buf[c]))
+            c++;
+
+        sequence_op_t op;
+
+        // Process substitutions and redirections start with [<], [>] or [&]
+        int redirect = c < n ? read_substitution(&p, in_buf, n, &c) : 0;
+
+        if (redirect == 0 && c < n)
+            redirect = read_redirect(&p, in_buf, n, &c);
+
+        /* CHECK IF METACHARACTER */
+        // [<(command)] [>(command)] Process substitution, [<] [>] [>>] [<>] [N>&M] [&>] Redirection
+        if (redirect != 0)
+        {
+            if (redirect == -1)
+            {
+                result = EXIT_FAILURE;
+                break;
             }
 
             continue;
         }
 
-        /* CHECK IF WRITING IN/OUT FILE PATH */
-        // Out file
-        if (status_output_redirect)
+        // End of input
+        else if (c >= n)
         {
-            out_waiting = false; // Indicate that a non-space character has been found
-            file_out[out_i++] = in_buf[c];
+            op = SEQUENCE_END;
+        }
 
-            continue;
+        // [;] Additional pipeline
+        else if (in_buf[c] == ';')
+        {
+            op = SEQUENCE_NEXT;
+            c++;
+        }
+
+        // [&&] Execute next pipeline on success
+        else if (in_buf[c] == '&' && in_buf[c + 1] == '&')
+        {
+            op = SEQUENCE_AND;
+            c += 2;
+        }
+
+        // [||] Execute next pipeline on failure
+        else if (in_buf[c] == '|' && in_buf[c + 1] == '|')
+        {
+            op = SEQUENCE_OR;
+            c += 2;
+        }
+
+        // [&] Execute pipeline in the background
+        else if (in_buf[c] == '&')
+        {
+            op = SEQUENCE_ASYNC;
+            c++;
         }
 
-        // In file
-        else if (status_input_redirect)
+        // [|] Pipe, [|*] Branch reading a copy of the producer's output
+        else if (in_buf[c] == '|')
         {
-            in_waiting = false; // Indicate that a non-space character has been found
-            file_in[in_i++] = in_buf[c];
+            bool fanout = in_buf[c + 1] == '*';
+
+            if (p.arg_count == 0)
+            {
+                result = syntax_error(fanout ? "|*" : "|");
+                break;
+            }
+
+            if (add_command(&p, fanout ? LINK_FANOUT : LINK_PIPE) == -1)
+            {
+                result = EXIT_FAILURE;
+                break;
+            }
 
+            c += fanout ? 2 : 1;
             continue;
         }
 
-        /* ADD NON-META CHARACTER TO PIPELINE */
+        /* ADD ARGUMENT TO PIPELINE */
         else
         {
-            if (k + 1 >= MAX_TOKEN_LENGTH)
+            size_t offset;
+            bool quoted = in_buf[c] == '"' || in_buf[c] == '\\'; // ["ls"] and [\ls] skip aliases
+            int word = read_word(&p, in_buf, n, &c, &offset);
+
+            if (word != 0 || (p.arg_count == 0 && !quoted ? expand_alias(&p, offset) : add_arg(&p, offset)) == -1)
             {
-                fprintf(stderr, "Too many characters passed to argument [%c%c%c%c%c...] in pipeline %d\n",
-                        pipeline[i][j][0], pipeline[i][j][1], pipeline[i][j][2], pipeline[i][j][3], pipeline[i][j][4], i + 1);
-                wait_for_semicolon = true;
-                execute = false;
-                continue;
+                if (word == 1)
+                    fprintf(stderr, "Syntax error: mismatched quotes\n");
+
+                result = EXIT_FAILURE;
+                break;
             }
 
-            pipeline[i][j][k++] = in_buf[c];
-            char_encountered = true;
-            status_pipe = false;
+            continue;
         }
-    }
 
-    if (status_quote)
-    {
-        fprintf(stderr, "Syntax error: mismatched quotes\n");
-        return EXIT_FAILURE;
-    }
+        /* CHECK SYNTAX */
+        // Empty pipeline: only valid as an empty line or after a trailing [;] or [&]
+        if (p.command_count == 1 && p.arg_count == 0)
+        {
+            if (op == SEQUENCE_END && (previous == SEQUENCE_NEXT || previous == SEQUENCE_ASYNC))
+            {
+                break;
+            }
 
-    pipeline[i][j + 1] = NULL;
-    pipeline[i][j][k] = '\0';
+            result = syntax_error(op_token(op == SEQUENCE_END ? previous : op));
+            break;
+        }
 
-    if (do_output_redirect)
-        file_out[strlen(file_out)] = '\0';
-    else
-        file_out = NULL;
+        // Pipe with no command following it
+        if (p.arg_count == 0)
+        {
+            result = syntax_error("|");
+            break;
+        }
 
-    if (do_input_redirect)
-        file_in[strlen(file_in)] = '\0';
-    else
-        file_in = NULL;
+        /* EXECUTE PIPELINE */
+        if (run)
+        {
+            if (run_pipeline(&p, op == SEQUENCE_ASYNC, final && op == SEQUENCE_END) == -1)
+            {
+                fprintf(stderr, "Exeuction failed\n");
+                result = EXIT_FAILURE;
+                break;
+            }
 
-    /* EXECUTE LAST PIPELINE IN COMMAND SEQUENCE */
-    // Attempt to execute command as buitlin
-    if (!(current_commands == 1 && (execute_builtin(**(pipeline + i), *(pipeline + i), false) == 0)))
-    {
-        // Execute command using execvp() in execute.c
-        if (execute_pipeline(current_commands, pipeline + (i - (current_commands - 1)), false, do_input_redirect ? file_in : NULL, do_output_redirect ? file_out : NULL, do_append_out) == 1)
+            // [set -e] Exit on failure, unless the pipeline is tested by [&&] or [||]
+            if (option_errexit && last_status != EXIT_SUCCESS && op != SEQUENCE_AND && op != SEQUENCE_OR)
+            {
+                exit(last_status);
+            }
+        }
+
+        if (op == SEQUENCE_END)
         {
-            return EXIT_FAILURE;
+            break;
         }
-    }
 
-    // Free pipeline
-    for (int i = 0; i < (MAX_PIPELINES * MAX_COMMANDS); i++)
-    {
-        for (int j = 0; j < MAX_ARGS; j++)
+        // Short-circuit: the next pipeline only runs if $? satisfies the operator
+        run = op == SEQUENCE_NEXT || op == SEQUENCE_ASYNC ||
+              (op == SEQUENCE_AND && last_status == EXIT_SUCCESS) ||
+              (op == SEQUENCE_OR && last_status != EXIT_SUCCESS);
+
+        previous = op;
+
+        if (reset_pipeline(&p) == -1)
         {
-            free(pipeline[i][j]);
-            pipeline[i][j] = NULL;
+            result = EXIT_FAILURE;
+            break;
         }
-        free(pipeline[i]);
-        pipeline[i] = NULL;
     }
 
-    free(pipeline);
-    pipeline[i] = NULL;
+    // Free pipeline
+    free_pipeline(&p);
 
-    return EXIT_SUCCESS;
+    return result;
+}
+
+// Tokenise and execute a command sequence, also used by the rc file
+int execute_line(const char *in_buf, size_t n)
+{
+    return execute_sequence(in_buf, n, false);
 }
 
-int main(void)
+// Tokenise and execute the last command sequence the shell runs, used by [-c] and subshells
+int execute_final_line(const char *in_buf, size_t n)
+{
+    return execute_sequence(in_buf, n, true);
+}
+
+int main(int argc, char **argv)
 {
     char cwd[128];
+    bool command_mode = argc > 2 && strcmp(argv[1], "-c") == 0;
+
+    if (supervisor_init(!command_mode && isatty(STDIN_FILENO)) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    rc_load();
+
+    // [tinyshell -c command] runs a single command line
+    if (command_mode)
+    {
+        execute_final_line(argv[2], strlen(argv[2]));
+        return last_status;
+    }
 
     // User prompt loop
     while (1)
     {
+        // Report background jobs which finished since the last prompt
+        supervisor_notify();
+
         if (getcwd(cwd, 128))
         {
             printf(ANSI_PROMPT "tiny_shell" ANSI_COLOR_RESET "@");
@@ -1,14 +1,393 @@
+#include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <fcntl.h>
+#include <sys/resource.h>
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define BUILTIN_NOT_FOUND -1  // Returned by execute_builtin() when name is not a builtin
+#define EXIT_SYNTAX_ERROR 2   // Exit status of a command sequence which failed to parse
+#define MAX_RLIMITS 8         // Max number of resource limits set by a single [limit] prefix
+#define MAX_CGROUP_PATH 256   // Max length of a cgroup directory path
+#define MAX_CPUS 1024         // Max CPU number accepted by [sched cpus=...]
+#define EXIT_TIMEOUT 124      // Exit status of a pipeline killed by [timeout]
+#define MAX_MEMO_ENV 8        // Max number of variables added to a [memo] key with -e
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Single setrlimit() applied to every stage of a pipeline
+typedef struct
+{
+    int resource;
+    rlim_t value;
+} rlimit_entry_t;
+
+// Scheduling attributes of a pipeline or a single stage, set by the [sched] prefix
+typedef struct
+{
+    unsigned char cpus[MAX_CPUS / 8]; // CPU affinity bitmap
+    int nice;
+    int ioprio; // ioprio_set() value, (class << 13) | level
+    int policy; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+
+    bool set_cpus,
+        set_nice,
+        set_ioprio,
+        set_policy;
+} sched_attr_t;
+
+// Measurements of a single run of a pipeline, taken for [bench]
+typedef struct
+{
+    double spawn;        // Seconds the shell spent setting up and forking the stages
+    struct rusage usage; // Summed over every stage and helper process, from wait4()
+} pipeline_stats_t;
+
+// Per-pipeline execution attributes, set by prefix commands such as [limit] and [sched]
+typedef struct
+{
+    // setrlimit() limits
+    rlimit_entry_t rlimits[MAX_RLIMITS];
+    int rlimit_count;
+
+    // cgroup v2 limits, a negative value leaves the controller's default
+    long long memory_max; // memory.max in bytes
+    long long cpu_quota;  // cpu.max quota in microseconds per CPU_PERIOD
+    long long pids_max;   // pids.max
+
+    char cgroup[MAX_CGROUP_PATH]; // Leaf cgroup created for the pipeline, empty if none
+
+    // Scheduling, stage_sched[i] overrides sched for stage i
+    sched_attr_t sched;
+    sched_attr_t *stage_sched; // One entry per stage, or NULL
+    bool spread;               // Pin each stage to a distinct CPU
+
+    // Deadline in seconds, 0 for none; stages then run in their own process group
+    double timeout;
+    double grace; // Seconds between SIGTERM and SIGKILL
+
+    // [bench] repetitions, 0 for a single ordinary run
+    int bench_runs;
+    int bench_warmup;
+    bool bench_quiet;        // Send the runs' STDOUT to /dev/null
+    pipeline_stats_t *stats; // Filled in by execute_pipeline() if not NULL
+
+    // [memo] output cache, variables named with -e are part of the key
+    bool memo;
+    char *memo_env[MAX_MEMO_ENV];
+    int memo_env_count;
+} pipeline_attr_t;
+
+// Kind of a single redirection
+typedef enum
+{
+    REDIRECT_INPUT,      // [N<file]
+    REDIRECT_OUTPUT,     // [N>file]
+    REDIRECT_APPEND,     // [N>>file]
+    REDIRECT_READ_WRITE, // [N<>file]
+    REDIRECT_DUPLICATE,  // [N>&M], [N<&M]
+    REDIRECT_CLOSE,      // [N>&-], [N<&-]
+    REDIRECT_INPUT_Z,    // [N<z file], decompressed
+    REDIRECT_OUTPUT_Z,   // [N>z file], compressed
+    REDIRECT_APPEND_Z    // [N>>z file], compressed
+} redirect_type_t;
+
+// Single redirection, applied in order to one stage of a pipeline
+typedef struct
+{
+    int stage;  // Index of the command it belongs to
+    int fd;     // File descriptor being redirected
+    redirect_type_t type;
+    char *path; // File path, NULL for REDIRECT_DUPLICATE and REDIRECT_CLOSE
+    int source; // File descriptor duplicated by REDIRECT_DUPLICATE, or the stage's end of
+                // the helper's pipe for a compressed redirection (-1 until it is started)
+} redirect_t;
+
+// Connection of a stage to the previous one
+typedef enum
+{
+    LINK_PIPE,  // [|] Reads the previous stage's output
+    LINK_FANOUT // [|*] Reads a copy of the producer's output (the stage before the first [|*])
+} pipe_link_t;
+
+// Pipes of a fan-out pipeline, see fanout.c
+typedef struct
+{
+    int producer;      // Stage whose output is copied to every branch, -1 for a linear chain
+    int output;        // Producer's end of the pipe to the copying process
+    int *branch_input; // Branch's end of its pipe for each stage starting a branch, else -1
+    int stages;
+} fanout_t;
+
+// Process substitution [<(command)] or [>(command)], replaced by [/dev/fd/N] in an argument
+typedef struct
+{
+    int stage;     // Index of the command it belongs to
+    char *command; // Command line run by the subshell
+    bool output;   // [>(command)]: the subshell reads what the stage writes to the path
+    char **arg;    // Argument replaced by path
+    int fd;        // Stage's end of the pipe, -1 until started
+    char path[32]; // /dev/fd/N
+} substitution_t;
+
+// SPSC byte ring joining two stages which run in-process, see inprocess.c
+typedef struct ring_t ring_t;
+
+// Input or output of a stage running in-process: a descriptor, or a ring if ring is not NULL
+typedef struct
+{
+    int fd;
+    ring_t *ring;
+    bool broken; // A write failed with EPIPE, the reader has gone
+} stream_t;
+
+// Runs a stage on a thread, returns its exit status
+typedef int (*inprocess_fn_t)(char **args, stream_t *in, stream_t *out);
+
+// Event recorded by [set -o trace=FILE]
+typedef enum
+{
+    TRACE_FORK,       // Stage forked, by the shell
+    TRACE_EXEC,       // About to execvp(), by the child
+    TRACE_OUTPUT,     // First output of a fan-out producer, by the copying process
+    TRACE_STOP,       // Stage stopped
+    TRACE_EXIT,       // Stage exited
+    TRACE_BUILTIN,    // Builtin started
+    TRACE_BUILTIN_END // Builtin returned
+} trace_type_t;
+
+// Pipeline supervised by the event loop in supervisor.c
+typedef struct job_t
+{
+    int id; // Background job number, 0 for foreground jobs
+    pid_t *pids;
+    int *status; // Exit status of each stage, valid once running is 0
+    int count;   // Number of stages started
+    int running; // Number of stages and helper processes which have not exited yet
+    bool background;
+    struct rusage usage;   // Summed over the children which have exited
+    pipeline_attr_t *attr; // Copy reported when a background job with a cgroup is done
+    struct job_t *next;
+} job_t;
+
+// Exit status
+extern int last_status;  // $?
+extern int *pipe_status; // ${PIPESTATUS[n]}
+extern int pipe_status_count;
+
+int record_status(const int *statuses, int count);
+
+// Shell options (set builtin)
+extern bool option_errexit;    // set -e
+extern bool option_pipefail;   // set -o pipefail
+extern bool option_trace;      // set -o trace=FILE
+extern bool option_scrollback; // set -o scrollback[=SIZE]
+extern bool option_inprocess;  // set -o inprocess
 
 // Execution
-int execute_pipeline(int argc, char **pipeline[], bool async, char *file_in, char *file_out, bool append_out);
+int execute_pipeline(int argc, char **pipeline[], const pipe_link_t *links, bool async, redirect_t *redirects, int redirect_count,
+                     substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr);
+
+int execute_line(const char *line, size_t length);
+
+int execute_final_line(const char *line, size_t length);
+
+_Noreturn void execute_in_place(char **args, redirect_t *redirects, int redirect_count);
+
+void init_attr(pipeline_attr_t *attr);
+
+// Resource limits
+long long parse_size(const char *value, bool allow_suffix);
+
+int parse_limit_prefix(char **args, pipeline_attr_t *attr);
+
+int limits_prepare(pipeline_attr_t *attr);
+
+int limits_apply(pipeline_attr_t *attr);
+
+void limits_report(pipeline_attr_t *attr);
+
+void limits_release(pipeline_attr_t *attr);
+
+// Scheduling
+void init_sched(sched_attr_t *sched);
+
+int parse_sched_prefix(char **args, sched_attr_t *sched, bool *spread);
+
+int sched_apply(pipeline_attr_t *attr, int stage);
+
+// Timeout
+int parse_timeout_prefix(char **args, pipeline_attr_t *attr);
+
+int wait_deadline(job_t *job, pid_t pgid, pipeline_attr_t *attr);
+
+// Benchmarking
+int parse_bench_prefix(char **args, pipeline_attr_t *attr);
+
+double bench_clock(void);
+
+int bench_pipeline(int argc, char **pipeline[], const pipe_link_t *links, redirect_t *redirects, int redirect_count,
+                   substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr);
+
+// Memoization
+int parse_memo_prefix(char **args, pipeline_attr_t *attr);
+
+int memo_pipeline(int argc, char **pipeline[], const pipe_link_t *links, redirect_t *redirects, int redirect_count,
+                  substitution_t *substitutions, int substitution_count, pipeline_attr_t *attr);
+
+void memo_stats(void);
+
+int memo_clear(void);
+
+// Child supervision
+extern int terminal_columns;
+extern int terminal_rows;
+
+int supervisor_init(bool is_interactive);
+
+void supervisor_child_reset(void);
+
+int supervisor_subshell(void);
+
+job_t *job_create(int count, bool background);
+
+int job_add(job_t *job, int stage, pid_t pid);
+
+void job_free(job_t *job);
+
+int supervisor_wait(job_t *job, double timeout);
+
+int supervisor_wait_input(int fd);
+
+int supervisor_watch(int fd, void (*ready)(int fd));
+
+void supervisor_unwatch(int fd);
+
+void supervisor_notify(void);
+
+int supervisor_wait_all(void);
+
+bool supervisor_jobs_pending(void);
+
+int decode_status(int status);
+
+// Scrollback
+void scrollback_start(int argc, char **pipeline[], int capture[2]);
+
+void scrollback_started(void);
+
+void scrollback_finish(int status);
+
+void scrollback_limit(size_t size);
+
+size_t scrollback_size(void);
+
+void scrollback_list(void);
+
+int scrollback_replay(int n, const char *pattern);
+
+// In-process stages
+void inprocess_plan(inprocess_fn_t *stages, int argc, char **pipeline[], const pipe_link_t *links, bool async,
+                    redirect_t *redirects, int redirect_count, substitution_t *substitutions, int substitution_count,
+                    pipeline_attr_t *attr);
+
+int inprocess_start(job_t *job, int stage, inprocess_fn_t run, char **args, stream_t in, stream_t out);
+
+ring_t *ring_create(void);
+
+void ring_close(ring_t *ring, bool writer);
+
+ssize_t stream_read(stream_t *stream, char *buffer, size_t length);
+
+int stream_write(stream_t *stream, const char *buffer, size_t length);
+
+void stream_close(stream_t *stream, bool writer);
+
+// Fan-out pipelines
+int fanout_start(job_t *job, fanout_t *fanout, const pipe_link_t *links, int argc);
+
+int fanout_child(fanout_t *fanout, int stage);
+
+void fanout_close(fanout_t *fanout);
+
+// Process substitution
+int start_substitutions(job_t *job, substitution_t *substitutions, int count, redirect_t *redirects, int redirect_count);
+
+int keep_substitutions(substitution_t *substitutions, int count, int stage, int *max_fd);
+
+void close_substitutions(substitution_t *substitutions, int count);
+
+// Tracing
+int trace_start(const char *path);
+
+void trace_stop(void);
+
+uint64_t trace_clock(void);
+
+void trace_begin_pipeline(void);
+
+void trace_record(uint64_t time, trace_type_t type, pid_t pid, int stage, int value, const char *name);
+
+void trace_flush(void);
+
+pid_t trace_shell(void);
+
+// rc file and aliases
+int rc_load(void);
+
+void rc_note_export(const char *name);
+
+const char *alias_lookup(const char *name);
+
+int alias_set(const char *name, const char *value);
+
+void alias_print(const char *name);
+
+uint64_t fnv1a(const char *data, size_t length);
+
+// Frecency directory database
+void frecency_visit(const char *path);
+
+void frecency_flush(void);
+
+const char *frecency_best(char **patterns);
+
+void frecency_list(char **patterns);
+
+// Lexer
+size_t scan_plain(const char *s, size_t n, bool quoted);
+
+// Input
+int read_line(int fd, char **out, size_t *length);
+
+bool input_exhausted(int fd);
 
 // Redirection
 int redirect_input(char *input);
 
 int redirect_output(char *output, int append_flag);
 
+int apply_redirects(redirect_t *redirects, int count, int stage, int *max_fd, int *failed);
+
+void redirect_error(const redirect_t *redirect, int error);
+
+bool has_compressed(redirect_t *redirects, int count);
+
+int start_compressed(job_t *job, redirect_t *redirects, int count, int stage);
+
+void close_compressed(redirect_t *redirects, int count, int stage);
+
+int close_inherited(int first);
+
 // Built-in commands
-int execute_builtin(char *name, char **args, bool async);
\ No newline at end of file
+extern _Thread_local FILE *builtin_output;
+
+int execute_builtin(char *name, char **args, bool async);
+
+bool builtin_exists(const char *name);
+
+bool builtin_threaded(const char *name);
+
+uint32_t options_saved(void);
+
+void options_restore(uint32_t mask);
@@ -0,0 +1,304 @@
+/* --------------------------------------- trace.c  --------------------------------------- */
+/* Provides pipeline timeline tracing, enabled with [set -o trace=FILE]. Events (fork,      */
+/* exec, first output of a fan-out producer, stop, exit, builtins) are recorded into a ring */
+/* buffer in shared memory, so forked children record their own events with nothing but     */
+/* clock_gettime() (a vDSO call) and an atomic increment. The ring is written to FILE in    */
+/* Chrome trace-event JSON format (chrome://tracing, ui.perfetto.dev) after each pipeline,  */
+/* with one track per process. The JSON array is closed by [set +o trace] or at exit.       */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tinyshell.h"
+
+/* -------------------------------------- CONSTANTS -------------------------------------- */
+#define TRACE_EVENTS 16384 // Events kept in the ring, older unflushed events are overwritten
+#define TRACE_NAME 48      // Max length of an event name, including the NUL
+
+/* ----------------------------------- TYPE DEFINITION ----------------------------------- */
+// Single recorded event, published once sequence is set
+typedef struct
+{
+    uint64_t sequence; // Index + 1 once the event is fully written
+    uint64_t time;     // CLOCK_MONOTONIC nanoseconds
+    pid_t pid;         // 0 if the recording process did not know it (exec, output)
+    int serial;        // Pipeline the event belongs to
+    int stage;         // Stage in the pipeline, -1 for helper processes
+    int value;         // Exit status
+    trace_type_t type;
+    char name[TRACE_NAME];
+} trace_event_t;
+
+// Ring shared with every child forked while tracing
+typedef struct
+{
+    uint64_t head;   // Next index to be reserved
+    int next_serial; // Pipeline counter, shared so subshells get distinct serials
+    trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+/* ---------------------------------------- STATE ---------------------------------------- */
+static trace_ring_t *ring = NULL;
+static FILE *trace_file = NULL;
+static pid_t owner = 0;        // Shell which started the trace, the only one writing the file
+static uint64_t flushed = 0;   // Index of the first event not yet written
+static uint64_t start_time = 0;
+static int current_serial = 0; // Inherited by the children of the current pipeline
+
+/* -------------------------------------- RECORDING -------------------------------------- */
+// Current time for trace_record(), or 0 without a syscall when tracing is off
+uint64_t trace_clock(void)
+{
+    struct timespec ts;
+
+    if (!ring)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start a new pipeline, events recorded from now on (and by children forked from now on)
+// belong to it
+void trace_begin_pipeline(void)
+{
+    if (ring)
+        current_serial = __atomic_add_fetch(&ring->next_serial, 1, __ATOMIC_RELAXED);
+}
+
+void trace_record(uint64_t time, trace_type_t type, pid_t pid, int stage, int value, const char *name)
+{
+    if (!ring)
+        return;
+
+    uint64_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *event = &ring->events[index % TRACE_EVENTS];
+
+    event->time = time;
+    event->pid = pid;
+    event->serial = current_serial;
+    event->stage = stage;
+    event->value = value;
+    event->type = type;
+
+    if (name)
+    {
+        strncpy(event->name, name, TRACE_NAME - 1);
+        event->name[TRACE_NAME - 1] = '\0';
+    }
+    else
+    {
+        event->name[0] = '\0';
+    }
+
+    __atomic_store_n(&event->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+/* --------------------------------------- WRITING --------------------------------------- */
+static void write_string(const char *s)
+{
+    fputc('"', trace_file);
+
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(trace_file, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(trace_file, "\\u%04x", *s);
+        else
+            fputc(*s, trace_file);
+    }
+
+    fputc('"', trace_file);
+}
+
+// Common fields of an event on the track of process tid
+static void write_header(const char *name, const char *phase, pid_t tid, uint64_t time)
+{
+    fprintf(trace_file, "{\"name\":");
+    write_string(name);
+    fprintf(trace_file, ",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", phase, owner, tid,
+            time > start_time ? (time - start_time) / 1000.0 : 0.0);
+}
+
+// Pid of the stage forked as (serial, stage), looked up among the forks in events
+static pid_t find_fork(trace_event_t *events, size_t count, int serial, int stage)
+{
+    for (size_t i = count; i-- > 0;)
+    {
+        if (events[i].type == TRACE_FORK && events[i].serial == serial && events[i].stage == stage)
+            return events[i].pid;
+    }
+
+    return 0;
+}
+
+static void write_event(trace_event_t *event, trace_event_t *events, size_t count)
+{
+    pid_t tid = event->pid;
+
+    // Children record exec and output without a getpid() call, the fork event names them
+    if (tid == 0)
+        tid = find_fork(events, count, event->serial, event->stage);
+
+    if (tid == 0)
+        return;
+
+    switch (event->type)
+    {
+    case TRACE_FORK:
+        fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", owner, tid);
+
+        char track[TRACE_NAME + 32];
+        snprintf(track, sizeof(track), "%d.%d %s (%d)", event->serial, event->stage, event->name, tid);
+        write_string(track);
+
+        fprintf(trace_file, "}},\n");
+        write_header(event->name, "B", tid, event->time);
+        break;
+
+    case TRACE_EXEC:
+        write_header("exec", "i", tid, event->time);
+        fprintf(trace_file, ",\"s\":\"t\"");
+        break;
+
+    case TRACE_OUTPUT:
+        write_header("first output", "i", tid, event->time);
+        fprintf(trace_file, ",\"s\":\"t\"");
+        break;
+
+    case TRACE_STOP:
+        write_header("stopped", "i", tid, event->time);
+        fprintf(trace_file, ",\"s\":\"t\"");
+        break;
+
+    case TRACE_EXIT:
+    case TRACE_BUILTIN_END:
+        write_header(event->name, "E", tid, event->time);
+        fprintf(trace_file, ",\"args\":{\"status\":%d}", event->value);
+        break;
+
+    case TRACE_BUILTIN:
+        write_header(event->name, "B", tid, event->time);
+        break;
+    }
+
+    fprintf(trace_file, "},\n");
+}
+
+// Write every published event which has not been written yet
+void trace_flush(void)
+{
+    if (!ring || getpid() != owner)
+        return;
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // Events overwritten before they could be written are lost
+    if (head - flushed > TRACE_EVENTS)
+    {
+        flushed = head - TRACE_EVENTS;
+    }
+
+    // Copy the batch out of the ring first, an event still being written ends it
+    size_t count = 0;
+    trace_event_t *events = malloc((head - flushed + 1) * sizeof(*events));
+
+    if (!events)
+        return;
+
+    for (uint64_t i = flushed; i < head; i++, count++)
+    {
+        trace_event_t *event = &ring->events[i % TRACE_EVENTS];
+
+        if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != i + 1)
+            break;
+
+        events[count] = *event;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        write_event(&events[i], events, count);
+    }
+
+    flushed += count;
+    fflush(trace_file);
+    free(events);
+}
+
+/* ------------------------------------- START/STOP -------------------------------------- */
+static void trace_exit(void)
+{
+    trace_stop();
+}
+
+// Start tracing to path, replacing any trace in progress. Returns 0, or -1 on error
+int trace_start(const char *path)
+{
+    static bool registered = false;
+
+    trace_stop();
+
+    trace_file = fopen(path, "we");
+
+    if (!trace_file)
+    {
+        fprintf(stderr, "set: trace: ");
+        perror(path);
+        return -1;
+    }
+
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap() failed");
+        fclose(trace_file);
+        ring = NULL;
+        trace_file = NULL;
+        return -1;
+    }
+
+    owner = getpid();
+    flushed = 0;
+    start_time = trace_clock();
+
+    fprintf(trace_file, "[\n");
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tinyshell\"}},\n", owner);
+    fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"shell (%d)\"}},\n", owner, owner, owner);
+    fflush(trace_file);
+
+    if (!registered)
+        registered = atexit(trace_exit) == 0;
+
+    return 0;
+}
+
+// Write the remaining events and close the trace
+void trace_stop(void)
+{
+    if (!ring || getpid() != owner)
+        return;
+
+    trace_flush();
+
+    write_header("trace end", "i", owner, trace_clock());
+    fprintf(trace_file, ",\"s\":\"g\"}\n]\n");
+    fclose(trace_file);
+
+    munmap(ring, sizeof(*ring));
+
+    ring = NULL;
+    trace_file = NULL;
+}
+
+// Pid recorded for events of the shell itself (builtins)
+pid_t trace_shell(void)
+{
+    return owner;
+}